@@ -0,0 +1,227 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the access log used by proxy.c
+ *
+ * Every thread that logs gets a ring of its own, with the thread as its only
+ * producer and the drain thread as its only consumer, so the two only have
+ * to agree on the head and tail indices. Those live on separate cache lines,
+ * so the producer does not bounce the line the consumer writes.
+ *
+ * See accesslog.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "accesslog.h"
+#include "csapp.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// size of a cache line
+#define CACHE_LINE 64
+
+// how long the drain thread sleeps when there is nothing to write, in ms
+#define DRAIN_INTERVAL_MS 10
+
+// size of the stdio buffer of the log file
+#define LOG_BUFSIZE (64 * 1024)
+
+/* Type for the ring buffer of one thread
+ *
+ * head is the next record to drain, and is only written by the drain thread
+ * tail is the next free slot, and is only written by the owning thread
+ * dropped counts the records that did not fit, reported the ones written
+ * to the log so far
+ */
+typedef struct ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+    uint64_t dropped;
+    uint64_t reported __attribute__((aligned(CACHE_LINE)));
+    struct ring *next;
+    log_record_t recs[LOG_RING_SIZE];
+} ring_t;
+
+static FILE *log_file = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *rings = NULL;
+static __thread ring_t *my_ring = NULL;
+
+/* Returns the ring of the calling thread, creating it on first use */
+static ring_t *get_ring(void) {
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    void *mem;
+    if (posix_memalign(&mem, CACHE_LINE, sizeof(ring_t)) != 0) {
+        perror("posix_memalign error");
+        exit(1);
+    }
+    ring_t *ring = memset(mem, 0, sizeof(ring_t));
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    my_ring = ring;
+    return ring;
+}
+
+/* Copies the address of a client into rec */
+void accesslog_addr(log_record_t *rec, const struct sockaddr *addr) {
+    rec->family = addr->sa_family;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memcpy(rec->addr, &in->sin_addr, sizeof(in->sin_addr));
+        rec->port = in->sin_port;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(rec->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        rec->port = in6->sin6_port;
+    }
+}
+
+/* Copies as much of src as fits into the size bytes at dst */
+static void copy_field(char *dst, size_t size, const char *src) {
+    size_t len = strnlen(src, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/* Copies as much of the method and uri of a request as fits into rec */
+void accesslog_request(log_record_t *rec, const char *method,
+                       const char *uri) {
+    copy_field(rec->method, sizeof(rec->method), method);
+    copy_field(rec->uri, sizeof(rec->uri), uri);
+}
+
+/* Logs rec, setting its time to now */
+void accesslog_write(log_record_t *rec) {
+    if (log_file == NULL) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    ring_t *ring = get_ring();
+    uint64_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->recs[tail % LOG_RING_SIZE] = *rec;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes rec to the log as a line in Common Log Format, followed by the
+ * time taken in seconds
+ */
+static void format_record(const log_record_t *rec) {
+    char host[INET6_ADDRSTRLEN] = "-";
+    if (rec->family == AF_INET || rec->family == AF_INET6) {
+        inet_ntop(rec->family, rec->addr, host, sizeof(host));
+    }
+
+    char date[32];
+    struct tm tm;
+    time_t secs = rec->time / 1000000;
+    gmtime_r(&secs, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+    char status[8] = "-";
+    if (rec->status != 0) {
+        snprintf(status, sizeof(status), "%u", rec->status);
+    }
+    char bytes[24] = "-";
+    if (rec->bytes != 0) {
+        snprintf(bytes, sizeof(bytes), "%" PRIu64, rec->bytes);
+    }
+
+    bool v6 = rec->family == AF_INET6;
+    fprintf(log_file, "%s%s%s:%u - - [%s] \"%s %s\" %s %s %.6f\n",
+            v6 ? "[" : "", host, v6 ? "]" : "", ntohs(rec->port), date,
+            rec->method, rec->uri, status, bytes,
+            (double)rec->duration / 1e6);
+}
+
+/* Writes out everything queued in ring
+ *
+ * Returns true if anything was written
+ */
+static bool drain_ring(ring_t *ring) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    bool any = head != tail;
+
+    for (; head != tail; head++) {
+        format_record(&ring->recs[head % LOG_RING_SIZE]);
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        fprintf(log_file, "# dropped %" PRIu64 " records\n",
+                dropped - ring->reported);
+        ring->reported = dropped;
+        any = true;
+    }
+    return any;
+}
+
+/* Body of the thread writing the log */
+static void *drain(void *vargp) {
+    struct timespec interval = {0, DRAIN_INTERVAL_MS * 1000000};
+
+    while (true) {
+        // rings are only ever added at the front, so the rest of the list
+        // can be walked without the lock
+        pthread_mutex_lock(&rings_lock);
+        ring_t *ring = rings;
+        pthread_mutex_unlock(&rings_lock);
+
+        bool any = false;
+        for (; ring != NULL; ring = ring->next) {
+            any |= drain_ring(ring);
+        }
+
+        if (any) {
+            fflush(log_file);
+        } else {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Opens the log file at path, and starts the thread writing to it */
+int accesslog_open(const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, LOG_BUFSIZE);
+    log_file = file;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, drain, NULL) != 0) {
+        log_file = NULL;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
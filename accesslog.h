@@ -0,0 +1,66 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for accesslog.c
+ *
+ * These files implement the access log of the proxy. Logging a request only
+ * copies a fixed size binary record into a ring buffer owned by the calling
+ * thread, without locks, syscalls or name lookups. A background thread
+ * drains all rings, formats the records, with addresses in numeric form, and
+ * writes them to the log file in large batches.
+ *
+ * When a ring is full, records are dropped rather than making the serving
+ * thread wait, and the number of dropped records is written to the log.
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// records in the ring buffer of every thread
+#define LOG_RING_SIZE 1024
+
+// bytes of the method and URI kept in a record
+#define LOG_METHOD_LEN 8
+#define LOG_URI_LEN 160
+
+/* Type for a record in the access log
+ *
+ * time is the wall clock time the request finished, in microseconds
+ * duration is the time taken to serve it, in microseconds
+ * status is the status code of the response, or 0 if unknown
+ * family, addr and port are the address of the client, in network order
+ * bytes is the size of the response, or 0 if unknown
+ * method and uri are the start of those of the request, null terminated
+ */
+typedef struct {
+    uint64_t time;
+    uint64_t duration;
+    uint64_t bytes;
+    uint16_t status;
+    uint16_t port;
+    uint8_t family;
+    uint8_t addr[16];
+    char method[LOG_METHOD_LEN];
+    char uri[LOG_URI_LEN];
+} log_record_t;
+
+/* Opens the log file at path, or standard output if path is "-", and starts
+ * the thread writing to it. Until this is called, nothing is logged
+ *
+ * Returns 0 on success, or -1 on error
+ */
+int accesslog_open(const char *path);
+
+/* Copies the address of a client into rec */
+void accesslog_addr(log_record_t *rec, const struct sockaddr *addr);
+
+/* Copies as much of the method and uri of a request as fits into rec */
+void accesslog_request(log_record_t *rec, const char *method,
+                       const char *uri);
+
+/* Logs rec, setting its time to now. Does nothing if no log is open */
+void accesslog_write(log_record_t *rec);
+
+#endif /* ACCESSLOG_H */
@@ -0,0 +1,220 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements admission control for proxy.c
+ *
+ * Connections are counted with atomic counters only. Per address counts live
+ * in a fixed table indexed by a hash of the address, so two addresses may
+ * share a slot, which only ever makes their limit stricter. IPv6 clients are
+ * counted per /64, since a single host usually owns at least that much.
+ *
+ * The adaptive limit follows the gradient approach: on every latency sample
+ * the limit is multiplied by min(1, TOLERANCE * slow / fast), which is 1
+ * while latency is stable and drops as it climbs, and is then given room to
+ * grow by sqrt(limit). Samples that arrive while another thread is updating
+ * the limit are skipped rather than waited for.
+ *
+ * See admit.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "admit.h"
+#include "csapp.h"
+#include "metrics.h"
+#include "options.h"
+
+#include <limits.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// descriptors kept aside for everything that is not a connection
+#define RESERVED_FDS 64
+
+// adaptive limit: latency ratio tolerated, and averaging weights
+#define TOLERANCE 2.0
+#define FAST_WEIGHT 0.1
+#define SLOW_WEIGHT 0.005
+#define SMOOTHING 0.2
+
+// adaptive limit to start from
+#define INITIAL_LIMIT 1000
+
+admit_opts_t admit_opts = {
+    .max_conns = 0,
+    .per_ip = 0,
+    .adaptive = false,
+    .min_limit = 64,
+};
+
+static const option_t options[] = {
+    {"max_conns", false, &admit_opts.max_conns,
+     "Most connections at once, 0 for the descriptor limit"},
+    {"per_ip", false, &admit_opts.per_ip,
+     "Most connections at once per client, 0 for no limit"},
+    {"adaptive", true, &admit_opts.adaptive,
+     "Limit connections further based on latency"},
+    {"min_limit", false, &admit_opts.min_limit,
+     "Smallest adaptive limit"},
+};
+
+static int inflight = 0;
+static uint32_t *ip_counts = NULL;
+
+// the adaptive limit, as read by admit, and the state it is computed from
+static int cur_limit = INT_MAX;
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+static double limit = 0;
+static double fast_latency = 0;
+static double slow_latency = 0;
+
+static const char reject_msg[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                 "Content-Type: text/plain\r\n"
+                                 "Content-Length: 20\r\n"
+                                 "Retry-After: 1\r\n"
+                                 "Connection: close\r\n\r\n"
+                                 "Proxy is overloaded\n";
+
+/* Sets the option described by spec, of the form "name=value" */
+int admit_parse(const char *spec) {
+    return options_parse(options, NUM_OPTIONS(options), spec, INT_MAX);
+}
+
+/* Prints the names and meaning of all options to stdout */
+void admit_usage(void) {
+    options_usage(options, NUM_OPTIONS(options));
+}
+
+/* Sets up admission control */
+void admit_init(void) {
+    // every connection holds a client and a server descriptor
+    struct rlimit rl;
+    if (admit_opts.max_conns == 0 && getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rlim_t fds = rl.rlim_cur;
+        fds = fds > RESERVED_FDS * 2 ? fds - RESERVED_FDS : fds / 2;
+        admit_opts.max_conns = fds / 2 < INT_MAX ? (int)(fds / 2) : INT_MAX;
+    }
+    if (admit_opts.max_conns == 0) {
+        admit_opts.max_conns = INT_MAX;
+    }
+
+    if (admit_opts.per_ip > 0) {
+        ip_counts = Calloc(ADMIT_IP_SLOTS, sizeof(uint32_t));
+    }
+
+    if (admit_opts.adaptive) {
+        limit = INITIAL_LIMIT < admit_opts.max_conns ? INITIAL_LIMIT
+                                                     : admit_opts.max_conns;
+        cur_limit = (int)limit;
+    }
+}
+
+/* Returns the slot of the table of per address counts for addr */
+static uint32_t ip_slot(const struct sockaddr *addr) {
+    const unsigned char *bytes;
+    size_t len;
+    if (addr->sa_family == AF_INET6) {
+        bytes = (const unsigned char *)&((struct sockaddr_in6 *)addr)
+                    ->sin6_addr;
+        len = 8;
+    } else {
+        bytes = (const unsigned char *)&((struct sockaddr_in *)addr)->sin_addr;
+        len = 4;
+    }
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash % ADMIT_IP_SLOTS;
+}
+
+/* Decides whether to serve a connection from the client at addr */
+bool admit(const struct sockaddr *addr, admit_ticket_t *ticket) {
+    int n = __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+    if (n > admit_opts.max_conns ||
+        n > __atomic_load_n(&cur_limit, __ATOMIC_RELAXED)) {
+        __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    *ticket = ADMIT_NO_SLOT;
+    if (ip_counts != NULL) {
+        uint32_t slot = ip_slot(addr);
+        uint32_t count = __atomic_add_fetch(&ip_counts[slot], 1,
+                                            __ATOMIC_RELAXED);
+        if (count > (uint32_t)admit_opts.per_ip) {
+            __atomic_sub_fetch(&ip_counts[slot], 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        *ticket = slot;
+    }
+    return true;
+}
+
+/* Gives back the admission of a connection that is done */
+void admit_release(admit_ticket_t ticket) {
+    if (ticket != ADMIT_NO_SLOT) {
+        __atomic_sub_fetch(&ip_counts[ticket], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+}
+
+/* Feeds the adaptive limit with the latency of a connection */
+void admit_observe(uint64_t accepted) {
+    if (!admit_opts.adaptive || pthread_mutex_trylock(&limit_lock) != 0) {
+        return;
+    }
+
+    double sample = (double)(metrics_now() - accepted);
+    if (fast_latency == 0) {
+        fast_latency = sample;
+        slow_latency = sample;
+    }
+    fast_latency += (sample - fast_latency) * FAST_WEIGHT;
+    slow_latency += (sample - slow_latency) * SLOW_WEIGHT;
+
+    // after an overload the slow average stays inflated for a long time, so
+    // let it come back down quickly once latency has recovered
+    if (slow_latency > TOLERANCE * fast_latency) {
+        slow_latency *= 0.95;
+    }
+    double gradient = TOLERANCE * slow_latency / fast_latency;
+    gradient = gradient < 0.5 ? 0.5 : gradient > 1.0 ? 1.0 : gradient;
+
+    double target = limit * gradient + sqrt(limit);
+    limit += (target - limit) * SMOOTHING;
+    if (limit < admit_opts.min_limit) {
+        limit = admit_opts.min_limit;
+    }
+    if (limit > admit_opts.max_conns) {
+        limit = admit_opts.max_conns;
+    }
+    __atomic_store_n(&cur_limit, (int)limit, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/* Turns the connection on connfd away with a 503 response, and closes it.
+ * Whatever the client already sent is read first, since closing a socket
+ * with unread data resets the connection and may lose the response
+ */
+void admit_reject(int connfd) {
+    metrics_count(METRIC_REJECTED, 1);
+    if (send(connfd, reject_msg, sizeof(reject_msg) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+        char buf[4096];
+        shutdown(connfd, SHUT_WR);
+        while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+            // discard the request
+        }
+    }
+    close(connfd);
+}
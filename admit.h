@@ -0,0 +1,87 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for admit.c
+ *
+ * These files implement admission control for proxy.c. Every accepted
+ * connection has to be admitted before it is served, and is turned away with
+ * an immediate 503 response when the proxy is over one of its limits:
+ *  - max_conns, the most connections served at once
+ *  - per_ip, the most connections served at once for a single client address
+ *  - the adaptive limit, when enabled. It follows the time from accept to the
+ *    first response byte, keeping a fast moving and a slow moving average of
+ *    it. While the fast one stays within twice the slow one the limit grows,
+ *    and as soon as latency climbs above that the limit shrinks in
+ *    proportion, so excess load is shed before queues build up
+ *
+ * Connections that are turned away never get any state allocated for them,
+ * so a flood costs an accept, a write and a close per connection.
+ */
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// slots in the table counting connections per client address
+#define ADMIT_IP_SLOTS 65536
+
+// value of a ticket that holds no per address slot
+#define ADMIT_NO_SLOT UINT32_MAX
+
+/* Type for the options of admission control
+ *
+ * max_conns is the most connections served at once, 0 to derive it from the
+ * limit on open descriptors
+ * per_ip is the most connections for one client address, 0 for no limit
+ * adaptive enables the adaptive limit
+ * min_limit is the smallest the adaptive limit can go
+ */
+typedef struct {
+    int max_conns;
+    int per_ip;
+    bool adaptive;
+    int min_limit;
+} admit_opts_t;
+
+/* Type for the admission of a connection, which must be given back with
+ * admit_release once the connection is done
+ */
+typedef uint32_t admit_ticket_t;
+
+/* The options in use, which start out as the defaults */
+extern admit_opts_t admit_opts;
+
+/* Sets the option described by spec, of the form "name=value"
+ *
+ * Returns 0 on success, or -1 if spec does not name a known option
+ */
+int admit_parse(const char *spec);
+
+/* Prints the names and meaning of all options to stdout */
+void admit_usage(void);
+
+/* Sets up admission control. Must be called after the limit on open
+ * descriptors has been raised, and before any connection is admitted
+ */
+void admit_init(void);
+
+/* Decides whether to serve a connection from the client at addr
+ *
+ * Returns true and fills in *ticket if it is admitted, or false otherwise
+ */
+bool admit(const struct sockaddr *addr, admit_ticket_t *ticket);
+
+/* Gives back the admission of a connection that is done */
+void admit_release(admit_ticket_t ticket);
+
+/* Feeds the adaptive limit with a connection that was accepted at the time
+ * accepted (see metrics.h) and has just sent its first response byte
+ */
+void admit_observe(uint64_t accepted);
+
+/* Turns the connection on connfd away with a 503 response, and closes it */
+void admit_reject(int connfd);
+
+#endif /* ADMIT_H */
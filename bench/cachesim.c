@@ -0,0 +1,305 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements cachesim, a trace-driven simulator of the cache
+ *
+ * cachesim replays an access trace against the real cache.c, once for every
+ * combination of cache and object size given, and reports the hit ratio,
+ * byte hit ratio, evictions and operations per second of each, so the
+ * limits can be picked from real traffic.
+ *
+ * A trace has one request per line, "timestamp url size", where timestamp
+ * is in seconds and size is that of the whole response in bytes. Blank
+ * lines and lines starting with # are skipped. A request that misses is
+ * added to the cache as a 200 response of that size, so the objects age
+ * with the default lifetimes, which -c sets the same way as for the proxy.
+ *
+ * cache.c is built with cachesim.h ahead of it, which makes the limits
+ * variables, and without metrics.c: cachesim provides metrics_count to
+ * collect what the cache counts, and metrics_now to run on trace time.
+ * Every combination runs in a child process of its own, so each starts
+ * from an empty cache.
+ *
+ * Usage: cachesim [-s size[,size]...] [-o size[,size]...] [-c name=value]...
+ *                 trace
+ */
+
+#define _GNU_SOURCE
+
+// ahead of cache.h, whose limits it replaces
+#include "cachesim.h"
+
+#include "cache.h"
+#include "csapp.h"
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+// most sizes given to -s or -o
+#define MAX_SIZES 32
+
+// head of every response added to the cache
+#define RESPONSE_HEAD "HTTP/1.0 200 OK\r\n\r\n"
+
+/* Type for a request of the trace
+ *
+ * time is relative to the first request, in ns
+ */
+typedef struct {
+    uint64_t time;
+    char *url;
+    size_t size;
+} access_t;
+
+size_t sim_cache_size;
+size_t sim_object_size;
+
+static uint64_t counters[METRIC_NUM_COUNTERS];
+static uint64_t sim_now;
+
+/* Returns the current time of the trace, for cache.c */
+uint64_t metrics_now(void) {
+    return sim_now;
+}
+
+/* Adds n to counter id, for cache.c */
+void metrics_count(counter_id id, uint64_t n) {
+    counters[id] += n;
+}
+
+/* Does nothing, cache.c records no latencies */
+void metrics_since(hist_id id, uint64_t start) {
+    (void)id;
+    (void)start;
+}
+
+/* Parses a size in bytes, with an optional K, M or G suffix
+ *
+ * Returns the size, or 0 if spec is not one
+ */
+static size_t parse_size(const char *spec) {
+    char *end;
+    double value = strtod(spec, &end);
+    switch (*end) {
+    case 'K':
+    case 'k':
+        value *= 1024;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        value *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' && value >= 1 ? (size_t)value : 0;
+}
+
+/* Parses a comma separated list of sizes into sizes
+ *
+ * Returns how many there are, or 0 if the list is malformed
+ */
+static int parse_sizes(char *list, size_t *sizes) {
+    int n = 0;
+    for (char *s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+        if (n == MAX_SIZES || (sizes[n++] = parse_size(s)) == 0) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/* Reads the trace at path
+ *
+ * Returns its requests, and stores how many there are in *n
+ */
+static access_t *read_trace(const char *path, size_t *n) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    size_t cap = 1024;
+    access_t *trace = Malloc(cap * sizeof(access_t));
+    *n = 0;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    double first = -1;
+    size_t lineno = 0;
+    while (getline(&line, &line_cap, file) >= 0) {
+        lineno++;
+        double time;
+        char url[MAXLINE];
+        unsigned long long size;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%lf %8191s %llu", &time, url, &size) != 3) {
+            fprintf(stderr, "%s:%zu: expected \"timestamp url size\"\n",
+                    path, lineno);
+            exit(1);
+        }
+
+        if (*n == cap) {
+            cap *= 2;
+            trace = Realloc(trace, cap * sizeof(access_t));
+        }
+        first = first < 0 ? time : first;
+        access_t *a = &trace[(*n)++];
+        a->time = time > first ? (uint64_t)((time - first) * NSEC_PER_SEC) : 0;
+        a->url = strdup(url);
+        a->size = size;
+    }
+    free(line);
+    fclose(file);
+    return trace;
+}
+
+/* Returns a response of size bytes, for the cache to own */
+static char *make_response(size_t size) {
+    char *buf = Malloc(size);
+    size_t head = sizeof(RESPONSE_HEAD) - 1;
+    if (size >= head) {
+        memcpy(buf, RESPONSE_HEAD, head);
+        memset(buf + head, 'x', size - head);
+    } else {
+        memset(buf, 'x', size);
+    }
+    return buf;
+}
+
+/* Replays the n requests of trace against an empty cache with the current
+ * limits, and prints the results as a row of the table
+ */
+static void replay(const access_t *trace, size_t n) {
+    cache_init();
+
+    uint64_t bytes = 0;
+    uint64_t hit_bytes = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; i++) {
+        const access_t *a = &trace[i];
+        sim_now = a->time;
+        bytes += a->size;
+
+        obj_t *obj = get_obj(a->url, sim_now);
+        if (obj != NULL) {
+            bool hit = obj_state(obj, sim_now) != CACHE_ERROR_ONLY;
+            hit_bytes += hit ? a->size : 0;
+            done_with(obj);
+            if (hit) {
+                continue;
+            }
+        }
+
+        char *key = strdup(a->url);
+        char *buf = make_response(a->size);
+        if (!add_obj(key, buf, a->size, sim_now)) {
+            free(key);
+            free(buf);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / (double)NSEC_PER_SEC;
+    uint64_t hits = counters[METRIC_CACHE_HITS];
+    printf("%12zu %12zu %10zu %8.2f%% %8.2f%% %10" PRIu64 " %12.0f\n",
+           sim_cache_size, sim_object_size, n,
+           n > 0 ? 100.0 * hits / n : 0.0,
+           bytes > 0 ? 100.0 * hit_bytes / bytes : 0.0,
+           counters[METRIC_CACHE_EVICTIONS], secs > 0 ? n / secs : 0.0);
+}
+
+/* Prints usage information and exits */
+static void usage(const char *prog) {
+    printf("Usage: %s [-s size[,size]...] [-o size[,size]...] "
+           "[-c name=value]... trace\n",
+           prog);
+    printf("  -s sizes  Cache sizes to try (default: %d)\n", 1024 * 1024);
+    printf("  -o sizes  Object sizes to try (default: %d)\n", 100 * 1024);
+    printf("  Sizes are in bytes, or with a K, M or G suffix\n");
+    printf("  -c name=value  Set a default cache lifetime, one of:\n");
+    cache_usage();
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t cache_sizes[MAX_SIZES] = {1024 * 1024};
+    size_t object_sizes[MAX_SIZES] = {100 * 1024};
+    int ncache = 1;
+    int nobject = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:o:c:")) != -1) {
+        switch (opt) {
+        case 's':
+            if ((ncache = parse_sizes(optarg, cache_sizes)) == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            if ((nobject = parse_sizes(optarg, object_sizes)) == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (cache_parse(optarg) < 0) {
+                printf("Unknown cache option %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    size_t n;
+    access_t *trace = read_trace(argv[optind], &n);
+
+    printf("%12s %12s %10s %9s %9s %10s %12s\n", "cache_size", "object_size",
+           "requests", "hits", "byte_hits", "evictions", "ops/sec");
+    fflush(stdout);
+    for (int c = 0; c < ncache; c++) {
+        for (int o = 0; o < nobject; o++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                exit(1);
+            }
+            if (pid == 0) {
+                sim_cache_size = cache_sizes[c];
+                sim_object_size = object_sizes[o];
+                replay(trace, n);
+                exit(0);
+            }
+            int status;
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Replay failed\n");
+                exit(1);
+            }
+        }
+    }
+    return 0;
+}
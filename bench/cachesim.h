@@ -0,0 +1,20 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file is included ahead of cache.c when it is built for cachesim.c
+ *
+ * It turns the limits of the cache into variables, so a single cachesim
+ * binary can replay a trace against many cache and object sizes.
+ */
+
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stddef.h>
+
+extern size_t sim_cache_size;
+extern size_t sim_object_size;
+
+#define MAX_CACHE_SIZE sim_cache_size
+#define MAX_OBJECT_SIZE sim_object_size
+
+#endif /* CACHESIM_H */
@@ -0,0 +1,541 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements loadgen, a load generator for benchmarking the proxy
+ *
+ * loadgen sends requests for a mix of URLs through the proxy, usually to
+ * Tiny, on an open-loop schedule: request k of thread i is due at a fixed
+ * time, start + (k * threads + i) / rate, whether or not earlier requests
+ * have been answered. The threads take turns, so requests are evenly spaced
+ * rather than sent in bursts of one per thread. At most a given number of
+ * requests are in flight at once, each on a connection of its own, since the
+ * proxy closes every connection after one response.
+ *
+ * Latency is measured from the time a request was due, not the time it was
+ * actually sent. When the proxy falls behind, requests wait for a free
+ * connection and that wait counts, so the percentiles are not flattered by
+ * coordinated omission. The time from sending to the end of the response is
+ * reported separately as the service time. Requests that were never sent
+ * by the end of the run, or never answered by the end of the drain, count
+ * towards latency with the time they had been waiting by then.
+ *
+ * Latencies go into log-linear histograms like those of metrics.c, with
+ * HIST_SUB_BUCKETS buckets per power of two of microseconds.
+ *
+ * Usage: loadgen [-c conns] [-t threads] [-r rate] [-d seconds]
+ *                -m url[=weight]... proxy_host:port
+ */
+
+#define _GNU_SOURCE
+
+#include "csapp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+
+// buckets per power of two in a histogram, and the largest power of two
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 35
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+// most URLs in the mix
+#define MAX_URLS 64
+
+// how long in-flight requests get to finish after the run, in seconds
+#define DRAIN_SECS 10
+
+// size of the buffer responses are read into
+#define READ_BUFSIZE (64 * 1024)
+
+/* Type for a URL of the mix, and the request for it */
+typedef struct {
+    char *url;
+    char *req;
+    size_t req_len;
+    double weight; // cumulative weight, up to and including this URL
+} target_t;
+
+/* Type for a latency histogram, in microseconds */
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/* Type for a request in flight
+ *
+ * fd is the connection to the proxy, or -1 while the slot is free
+ * due is the time the request was due, sent the time it was sent
+ * sent_len is how much of the request has been written
+ * status holds the start of the response, for its status code
+ */
+typedef struct {
+    int fd;
+    const target_t *target;
+    uint64_t due;
+    uint64_t sent;
+    size_t sent_len;
+    uint64_t bytes;
+    char status[16];
+    size_t status_len;
+} conn_t;
+
+/* Type for the state and results of a thread
+ *
+ * first is the time the first request of this thread is due, and interval
+ * the time between two of its requests, both in ns
+ */
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    conn_t *conns;
+    int *free_conns;
+    int nfree;
+    uint64_t first;
+    uint64_t interval;
+    uint64_t rng;
+    uint64_t started;
+    uint64_t missed;
+    uint64_t ok;
+    uint64_t errors;
+    uint64_t bytes;
+    hist_t latency;
+    hist_t service;
+} worker_t;
+
+static target_t targets[MAX_URLS];
+static int ntargets = 0;
+static double total_weight = 0;
+
+static struct addrinfo *proxy_addr;
+static int nconns = 64;
+static int nthreads = 1;
+static double rate = 1000;
+static double duration = 10;
+static uint64_t start_time;
+
+/* Returns the current monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Returns the index of the bucket that holds v microseconds */
+static size_t bucket_of(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return v;
+    }
+
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = exp - HIST_SUB_BITS;
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((v >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Returns the smallest value in microseconds above bucket idx */
+static uint64_t bucket_limit(size_t idx) {
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx + 1;
+    }
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = idx % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub + 1) << shift;
+}
+
+/* Records the time from start to end, in ns, in hist */
+static void record(hist_t *hist, uint64_t start, uint64_t end) {
+    uint64_t us = end > start ? (end - start) / 1000 : 0;
+    hist->count += 1;
+    hist->buckets[bucket_of(us)] += 1;
+    if (us > hist->max) {
+        hist->max = us;
+    }
+}
+
+/* Adds the counts of from to those of to */
+static void merge(hist_t *to, const hist_t *from) {
+    to->count += from->count;
+    to->max = from->max > to->max ? from->max : to->max;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        to->buckets[b] += from->buckets[b];
+    }
+}
+
+/* Returns the value in microseconds below which a fraction q of the values
+ * in hist fall, at the resolution of its buckets
+ */
+static uint64_t quantile(const hist_t *hist, double q) {
+    uint64_t count = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        count += hist->buckets[b];
+        if (count > 0 && count >= q * hist->count) {
+            uint64_t limit = bucket_limit(b);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/* Adds url to the mix with the given weight
+ *
+ * Returns 0 on success, or -1 if url is not an http:// URL
+ */
+static int add_target(const char *spec) {
+    char *url = strdup(spec);
+    double weight = 1;
+    char *eq = strrchr(url, '=');
+    if (eq != NULL && strchr(eq, '/') == NULL) {
+        *eq = '\0';
+        weight = atof(eq + 1);
+    }
+    if (ntargets == MAX_URLS || strncmp(url, "http://", 7) != 0 ||
+        weight <= 0) {
+        free(url);
+        return -1;
+    }
+
+    const char *host = url + 7;
+    const char *path = strchr(host, '/');
+    int host_len = path != NULL ? (int)(path - host) : (int)strlen(host);
+    target_t *t = &targets[ntargets++];
+    t->url = url;
+    t->req = Malloc(MAXLINE);
+    t->req_len = snprintf(t->req, MAXLINE,
+                          "GET %s HTTP/1.0\r\nHost: %.*s\r\n"
+                          "Connection: close\r\n\r\n",
+                          url, host_len, host);
+    total_weight += weight;
+    t->weight = total_weight;
+    return 0;
+}
+
+/* Returns a random URL of the mix, chosen by weight */
+static const target_t *pick_target(worker_t *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    uint64_t r = w->rng * 2685821657736338717ull;
+    double x = (double)(r >> 11) / (double)(1ull << 53) * total_weight;
+    for (int i = 0; i < ntargets - 1; i++) {
+        if (x < targets[i].weight) {
+            return &targets[i];
+        }
+    }
+    return &targets[ntargets - 1];
+}
+
+/* Closes the connection of c and frees its slot */
+static void finish(worker_t *w, conn_t *c, bool ok) {
+    close(c->fd);
+    c->fd = -1;
+    w->free_conns[w->nfree++] = c - w->conns;
+    if (!ok) {
+        w->errors += 1;
+        return;
+    }
+
+    uint64_t now = now_ns();
+    w->ok += 1;
+    w->bytes += c->bytes;
+    record(&w->latency, c->due, now);
+    record(&w->service, c->sent, now);
+}
+
+/* Starts the request that was due at time due on a free connection */
+static void start_request(worker_t *w, uint64_t due) {
+    conn_t *c = &w->conns[w->free_conns[--w->nfree]];
+    memset(c, 0, sizeof(*c));
+    c->target = pick_target(w);
+    c->due = due;
+    c->sent = now_ns();
+
+    c->fd = socket(proxy_addr->ai_family,
+                   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(c->fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        finish(w, c, false);
+        return;
+    }
+
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/* Makes progress on the request of c, which is ready for events */
+static void handle(worker_t *w, conn_t *c, uint32_t events, char *buf) {
+    if (c->sent_len < c->target->req_len) {
+        const target_t *t = c->target;
+        ssize_t n = send(c->fd, t->req + c->sent_len, t->req_len - c->sent_len,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                finish(w, c, false);
+            }
+            return;
+        }
+        c->sent_len += n;
+        if (c->sent_len == t->req_len) {
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+            epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    while (true) {
+        ssize_t n = recv(c->fd, buf, READ_BUFSIZE, 0);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                finish(w, c, false);
+            }
+            return;
+        }
+        if (n == 0) {
+            // "HTTP/1.x 200"
+            bool ok = c->status_len >= 12 &&
+                      strncmp(c->status + 9, "200", 3) == 0;
+            finish(w, c, ok);
+            return;
+        }
+        if (c->status_len < sizeof(c->status)) {
+            size_t m = sizeof(c->status) - c->status_len;
+            m = (size_t)n < m ? (size_t)n : m;
+            memcpy(c->status + c->status_len, buf, m);
+            c->status_len += m;
+        }
+        c->bytes += n;
+    }
+}
+
+/* Waits for events on epfd like epoll_wait, for at most timeout ns, or for
+ * ever if it is UINT64_MAX. Requests are often due less than a millisecond
+ * apart, so the timeout is not rounded to milliseconds, except on kernels
+ * without epoll_pwait2, where it is rounded up so the wait never spins
+ */
+static int wait_events(int epfd, struct epoll_event *events, int max,
+                       uint64_t timeout) {
+    if (timeout == UINT64_MAX) {
+        return epoll_wait(epfd, events, max, -1);
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeout / NSEC_PER_SEC;
+    ts.tv_nsec = timeout % NSEC_PER_SEC;
+    int n = epoll_pwait2(epfd, events, max, &ts, NULL);
+    if (n < 0 && errno == ENOSYS) {
+        n = epoll_wait(epfd, events, max,
+                       (int)((timeout + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC));
+    }
+    return n;
+}
+
+/* Body of a thread sending requests */
+static void *run(void *vargp) {
+    worker_t *w = vargp;
+    char *buf = Malloc(READ_BUFSIZE);
+    struct epoll_event events[64];
+
+    uint64_t end = start_time + (uint64_t)(duration * NSEC_PER_SEC);
+    uint64_t deadline = end + DRAIN_SECS * NSEC_PER_SEC;
+    while (true) {
+        uint64_t now = now_ns();
+
+        // start every request that is due, as long as connections are free,
+        // until the end of the run
+        uint64_t due = w->first + w->started * w->interval;
+        bool sending = now < end && due < end;
+        while (sending && due <= now && w->nfree > 0) {
+            start_request(w, due);
+            w->started += 1;
+            due = w->first + w->started * w->interval;
+            sending = due < end;
+        }
+
+        int inflight = nconns - w->nfree;
+        if ((!sending && inflight == 0) || now >= deadline) {
+            break;
+        }
+
+        // wait for the next request to be due, or for a connection to free,
+        // but never past the end of the run or of the drain
+        uint64_t timeout = sending ? end - now : deadline - now;
+        if (sending && w->nfree > 0) {
+            timeout = due > now ? due - now : 0;
+        }
+        int n = wait_events(w->epfd, events, 64, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            handle(w, events[i].data.ptr, events[i].events, buf);
+        }
+    }
+
+    // requests never sent by the end of the run, or never answered by the
+    // end of the drain. Both count towards latency, with the time they had
+    // waited, and those never answered are errors too
+    uint64_t total =
+        end > w->first ? (end - w->first + w->interval - 1) / w->interval : 0;
+    w->missed = total > w->started ? total - w->started : 0;
+    uint64_t now = now_ns();
+    for (uint64_t k = w->started; k < total; k++) {
+        record(&w->latency, w->first + k * w->interval, now);
+    }
+    for (int i = 0; i < nconns; i++) {
+        if (w->conns[i].fd >= 0) {
+            record(&w->latency, w->conns[i].due, now);
+        }
+    }
+    w->errors += nconns - w->nfree;
+    free(buf);
+    return NULL;
+}
+
+/* Prints usage information and exits */
+static void usage(const char *prog) {
+    printf("Usage: %s [-c conns] [-t threads] [-r rate] [-d seconds] "
+           "-m url[=weight]... proxy_host:port\n",
+           prog);
+    printf("  -c conns    Most requests in flight per thread (default: %d)\n",
+           nconns);
+    printf("  -t threads  Threads sending requests (default: %d)\n",
+           nthreads);
+    printf("  -r rate     Requests per second, over all threads "
+           "(default: %.0f)\n",
+           rate);
+    printf("  -d seconds  Length of the run (default: %.0f)\n", duration);
+    printf("  -m url=w    Request url, with weight w in the mix "
+           "(default: 1)\n");
+    exit(1);
+}
+
+/* Prints the percentiles of hist, under the given name */
+static void print_hist(const char *name, const hist_t *hist) {
+    printf("%-13s p50 %8.3f  p90 %8.3f  p99 %8.3f  p99.9 %8.3f  "
+           "max %8.3f ms\n",
+           name, quantile(hist, 0.5) / 1e3, quantile(hist, 0.9) / 1e3,
+           quantile(hist, 0.99) / 1e3, quantile(hist, 0.999) / 1e3,
+           hist->max / 1e3);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:r:d:m:")) != -1) {
+        switch (opt) {
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'm':
+            if (add_target(optarg) < 0) {
+                printf("Bad URL %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || ntargets == 0 || nconns <= 0 || nthreads <= 0 ||
+        rate <= 0 || duration <= 0) {
+        usage(argv[0]);
+    }
+
+    // resolve the proxy once, up front
+    char *host = argv[optind];
+    char *port = strrchr(host, ':');
+    if (port == NULL) {
+        usage(argv[0]);
+    }
+    *port++ = '\0';
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    int res = getaddrinfo(host, port, &hints, &proxy_addr);
+    if (res != 0) {
+        printf("Cannot resolve %s: %s\n", host, gai_strerror(res));
+        exit(1);
+    }
+
+    worker_t *workers = Calloc(nthreads, sizeof(worker_t));
+    start_time = now_ns() + 10 * NSEC_PER_MSEC;
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->conns = Calloc(nconns, sizeof(conn_t));
+        w->free_conns = Calloc(nconns, sizeof(int));
+        for (int c = 0; c < nconns; c++) {
+            w->conns[c].fd = -1;
+            w->free_conns[w->nfree++] = c;
+        }
+        w->interval = (uint64_t)(NSEC_PER_SEC * nthreads / rate);
+        w->interval = w->interval > 0 ? w->interval : 1;
+        w->first = start_time + w->interval * i / nthreads;
+        w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        if (pthread_create(&w->tid, NULL, run, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    worker_t total = {0};
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        total.started += w->started;
+        total.missed += w->missed;
+        total.ok += w->ok;
+        total.errors += w->errors;
+        total.bytes += w->bytes;
+        merge(&total.latency, &w->latency);
+        merge(&total.service, &w->service);
+    }
+    double secs = (now_ns() - start_time) / (double)NSEC_PER_SEC;
+
+    printf("requests      %" PRIu64 " ok, %" PRIu64 " errors, %" PRIu64
+           " never sent\n",
+           total.ok, total.errors, total.missed);
+    printf("throughput    %.1f req/s (target %.1f), %.2f MB/s\n",
+           total.ok / secs, rate, total.bytes / secs / 1e6);
+    print_hist("latency", &total.latency);
+    print_hist("service time", &total.service);
+
+    freeaddrinfo(proxy_addr);
+    return total.errors == 0 && total.missed == 0 ? 0 : 2;
+}
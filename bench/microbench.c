@@ -0,0 +1,433 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements microbench, micro-benchmarks of the proxy's hot paths
+ *
+ * Every benchmark times one operation, such as parsing a request header or
+ * looking an object up in the cache, over many iterations. It is run for
+ * ROUNDS rounds of about ROUND_NS each, and the median round is reported in
+ * nanoseconds per operation, which keeps one-off hiccups such as a context
+ * switch out of the result.
+ *
+ * proxy.c is included right here, with its main renamed, so its functions
+ * and types can be called and filled in directly. Everything else links
+ * against the objects the proxy itself is built from, with the same flags,
+ * so the numbers are those of the code that ships.
+ *
+ * With -b, the results are compared against a baseline written earlier with
+ * -w, and microbench fails if any operation got more than the tolerance
+ * slower. Baselines only mean something on the machine they were taken on.
+ *
+ * Usage: microbench [-b baseline] [-w baseline] [-t percent] [name]...
+ */
+
+#define main proxy_main
+#include "proxy.c"
+#undef main
+
+#include <time.h>
+
+// rounds every benchmark is run for, and the length of a round, in ns
+#define ROUNDS 7
+#define ROUND_NS 100000000ull
+
+// objects in the cache for the lookup benchmark
+#define BENCH_OBJECTS 256
+
+// size of the objects added to the cache
+#define BENCH_OBJECT_SIZE 4096
+
+// lines written to the socket pair at once by the readline benchmarks
+#define BENCH_LINES 64
+
+// most benchmarks in a baseline
+#define MAX_BENCHES 64
+
+/* Type for a benchmark
+ *
+ * setup, if not NULL, runs before the first round
+ * fn runs the operation iters times
+ */
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*fn)(uint64_t iters);
+} bench_t;
+
+/* Type for an entry of a baseline */
+typedef struct {
+    char name[64];
+    double ns;
+} result_t;
+
+static const char *header_lines[] = {
+    "Host: www.cmu.edu:8080\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:3.10.0)\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Accept-Encoding: gzip, deflate\r\n",
+    "Connection: keep-alive\r\n",
+    "Proxy-Connection: keep-alive\r\n",
+    "Cache-Control: max-age=0\r\n",
+};
+
+#define NUM_HEADER_LINES (sizeof(header_lines) / sizeof(header_lines[0]))
+
+static const char *bench_uri =
+    "http://www.cmu.edu:8080/academics/index.html";
+
+static client_info bench_client;
+static request_t bench_req;
+static char *cache_keys[BENCH_OBJECTS];
+static uint64_t next_key = 0;
+static int sockets[2];
+static char lines[BENCH_LINES * 128];
+static size_t lines_len;
+
+// keeps the compiler from dropping results that are never used
+static volatile uint64_t sink;
+
+/* Returns the current monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Parses a full set of request headers, one header line per operation */
+static void bench_read_requesthdr(uint64_t iters) {
+    bench_client.req = &bench_req;
+    for (uint64_t i = 0; i < iters; i++) {
+        size_t h = i % NUM_HEADER_LINES;
+        if (h == 0) {
+            bench_req.host_header[0] = '\0';
+            bench_req.prev_write = 0;
+        }
+        read_requesthdr(&bench_client, header_lines[h],
+                        strlen(header_lines[h]));
+    }
+    sink += bench_req.prev_write;
+}
+
+/* Splits a URI into host, port and path */
+static void bench_get_conn_info(uint64_t iters) {
+    char uri[MAXLINE];
+    strcpy(uri, bench_uri);
+    for (uint64_t i = 0; i < iters; i++) {
+        get_conn_info(&bench_client, uri, bench_req.hostname, bench_req.port,
+                      bench_req.dir);
+    }
+    sink += bench_req.dir[0];
+}
+
+/* Fills in a parsed request, as serve has it before building it */
+static void setup_build_request(void) {
+    char uri[MAXLINE];
+    strcpy(uri, bench_uri);
+    memset(&bench_req, 0, sizeof(bench_req));
+    get_conn_info(&bench_client, uri, bench_req.hostname, bench_req.port,
+                  bench_req.dir);
+    bench_client.req = &bench_req;
+    for (size_t h = 0; h < NUM_HEADER_LINES; h++) {
+        read_requesthdr(&bench_client, header_lines[h],
+                        strlen(header_lines[h]));
+    }
+}
+
+/* Builds the request sent to the server */
+static void bench_build_request(uint64_t iters) {
+    for (uint64_t i = 0; i < iters; i++) {
+        build_request(&bench_req);
+    }
+    sink += bench_req.req_length;
+}
+
+/* Returns a response of BENCH_OBJECT_SIZE bytes, for the cache to own */
+static char *make_object(void) {
+    static const char head[] = "HTTP/1.0 200 OK\r\n\r\n";
+    char *buf = Malloc(BENCH_OBJECT_SIZE);
+    memcpy(buf, head, sizeof(head) - 1);
+    memset(buf + sizeof(head) - 1, 'x',
+           BENCH_OBJECT_SIZE - (sizeof(head) - 1));
+    return buf;
+}
+
+/* Fills the cache with BENCH_OBJECTS objects */
+static void setup_get_obj(void) {
+    for (int i = 0; i < BENCH_OBJECTS; i++) {
+        char key[MAXLINE];
+        snprintf(key, sizeof(key), "http://www.cmu.edu/object/%d", i);
+        cache_keys[i] = strdup(key);
+        add_obj(strdup(key), make_object(), BENCH_OBJECT_SIZE,
+                metrics_now());
+    }
+}
+
+/* Looks up an object in the cache and gives it back */
+static void bench_get_obj(uint64_t iters) {
+    uint64_t now = metrics_now();
+    for (uint64_t i = 0; i < iters; i++) {
+        obj_t *obj = get_obj(cache_keys[i % BENCH_OBJECTS], now);
+        if (obj != NULL) {
+            sink += obj->size;
+            done_with(obj);
+        }
+    }
+}
+
+/* Adds an object that is not in the cache yet */
+static void add_new_obj(uint64_t now) {
+    char key[MAXLINE];
+    snprintf(key, sizeof(key), "http://www.cmu.edu/new/%" PRIu64, next_key++);
+    add_obj(strdup(key), make_object(), BENCH_OBJECT_SIZE, now);
+}
+
+/* Fills the cache up, so every object added after that evicts one */
+static void setup_add_obj(void) {
+    uint64_t now = metrics_now();
+    for (int i = 0; i < MAX_CACHE_SIZE / BENCH_OBJECT_SIZE; i++) {
+        add_new_obj(now);
+    }
+}
+
+/* Adds a new object to the full cache, which evicts the oldest one */
+static void bench_add_obj(uint64_t iters) {
+    uint64_t now = metrics_now();
+    for (uint64_t i = 0; i < iters; i++) {
+        add_new_obj(now);
+    }
+}
+
+/* Creates the socket pair the readline benchmarks read lines from */
+static void setup_readline(void) {
+    if (sockets[0] == 0 &&
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    lines_len = 0;
+    for (int i = 0; i < BENCH_LINES; i++) {
+        lines_len += snprintf(lines + lines_len, sizeof(lines) - lines_len,
+                              "%s", header_lines[i % 4]);
+    }
+}
+
+/* Reads a line from a socket with rio_readlineb */
+static void bench_rio_readlineb(uint64_t iters) {
+    rio_t rio;
+    char buf[MAXLINE];
+    rio_readinitb(&rio, sockets[1]);
+    for (uint64_t i = 0; i < iters; i++) {
+        if (i % BENCH_LINES == 0 &&
+            rio_writen(sockets[0], lines, lines_len) < 0) {
+            perror("rio_writen");
+            exit(1);
+        }
+        sink += rio_readlineb(&rio, buf, sizeof(buf));
+    }
+    // drain what is left of the last batch
+    while (iters % BENCH_LINES != 0) {
+        sink += rio_readlineb(&rio, buf, sizeof(buf));
+        iters++;
+    }
+}
+
+/* Reads a line from a reader without copying it, and consumes it */
+static void read_nbio_line(nbio_t *rio) {
+    char *line;
+    ssize_t n = nbio_peekline(rio, &line);
+    if (n > 0) {
+        sink += n;
+        nbio_consume(rio, n);
+    }
+}
+
+/* Reads a line from a socket with nbio_peekline and nbio_consume, as the
+ * proxy does
+ */
+static void bench_nbio_peekline(uint64_t iters) {
+    nbio_t rio;
+    nbio_readinitb(&rio, sockets[1]);
+    for (uint64_t i = 0; i < iters; i++) {
+        if (i % BENCH_LINES == 0 &&
+            rio_writen(sockets[0], lines, lines_len) < 0) {
+            perror("rio_writen");
+            exit(1);
+        }
+        read_nbio_line(&rio);
+    }
+    while (iters % BENCH_LINES != 0) {
+        read_nbio_line(&rio);
+        iters++;
+    }
+    nbio_free(&rio);
+}
+
+static const bench_t benches[] = {
+    {"read_requesthdr", NULL, bench_read_requesthdr},
+    {"get_conn_info", NULL, bench_get_conn_info},
+    {"build_request", setup_build_request, bench_build_request},
+    {"get_obj", setup_get_obj, bench_get_obj},
+    {"add_obj_evict", setup_add_obj, bench_add_obj},
+    {"rio_readlineb", setup_readline, bench_rio_readlineb},
+    {"nbio_peekline", setup_readline, bench_nbio_peekline},
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* Compares two doubles, for qsort */
+static int compare_ns(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs bench, and returns the median time per operation, in ns */
+static double run_bench(const bench_t *bench) {
+    if (bench->setup != NULL) {
+        bench->setup();
+    }
+
+    // find how many iterations take about a round, warming up on the way
+    uint64_t iters = 1;
+    while (true) {
+        uint64_t start = now_ns();
+        bench->fn(iters);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= ROUND_NS / 10) {
+            iters = iters * ROUND_NS / (elapsed > 0 ? elapsed : 1);
+            break;
+        }
+        iters *= 2;
+    }
+    iters = iters > 0 ? iters : 1;
+
+    double ns[ROUNDS];
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t start = now_ns();
+        bench->fn(iters);
+        ns[r] = (double)(now_ns() - start) / iters;
+    }
+    qsort(ns, ROUNDS, sizeof(double), compare_ns);
+    return ns[ROUNDS / 2];
+}
+
+/* Reads the baseline at path into results
+ *
+ * Returns how many entries it has
+ */
+static int read_baseline(const char *path, result_t *results) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    char line[MAXLINE];
+    int n = 0;
+    while (n < MAX_BENCHES && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] != '#' &&
+            sscanf(line, "%63s %lf", results[n].name, &results[n].ns) == 2) {
+            n++;
+        }
+    }
+    fclose(file);
+    return n;
+}
+
+/* Returns true if name was asked for on the command line, or nothing was */
+static bool wanted(const char *name, char **names, int nnames) {
+    for (int i = 0; i < nnames; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return true;
+        }
+    }
+    return nnames == 0;
+}
+
+/* Prints usage information and exits */
+static void bench_usage(const char *prog) {
+    printf("Usage: %s [-b baseline] [-w baseline] [-t percent] [name]...\n",
+           prog);
+    printf("  -b file     Fail if slower than the baseline in file\n");
+    printf("  -w file     Write the results to file, as a new baseline\n");
+    printf("  -t percent  Slowdown tolerated against the baseline "
+           "(default: 25)\n");
+    printf("  Benchmarks:");
+    for (size_t i = 0; i < NUM_BENCHES; i++) {
+        printf(" %s", benches[i].name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *baseline_path = NULL;
+    const char *write_path = NULL;
+    double tolerance = 25;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:t:")) != -1) {
+        switch (opt) {
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+
+    result_t baseline[MAX_BENCHES];
+    int nbaseline = 0;
+    if (baseline_path != NULL) {
+        nbaseline = read_baseline(baseline_path, baseline);
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    cache_init();
+
+    FILE *out = NULL;
+    if (write_path != NULL && (out = fopen(write_path, "w")) == NULL) {
+        perror(write_path);
+        exit(1);
+    }
+    if (out != NULL) {
+        fprintf(out, "# ns/op, from bench/microbench -w\n");
+    }
+
+    bool failed = false;
+    for (size_t i = 0; i < NUM_BENCHES; i++) {
+        const bench_t *bench = &benches[i];
+        if (!wanted(bench->name, argv + optind, argc - optind)) {
+            continue;
+        }
+
+        double ns = run_bench(bench);
+        printf("%-16s %10.1f ns/op", bench->name, ns);
+        for (int b = 0; b < nbaseline; b++) {
+            if (strcmp(baseline[b].name, bench->name) != 0) {
+                continue;
+            }
+            double change = (ns / baseline[b].ns - 1) * 100;
+            bool slower = change > tolerance;
+            printf("  %+6.1f%% vs %.1f%s", change, baseline[b].ns,
+                   slower ? "  REGRESSION" : "");
+            failed |= slower;
+        }
+        printf("\n");
+        fflush(stdout);
+        if (out != NULL) {
+            fprintf(out, "%s %.1f\n", bench->name, ns);
+        }
+    }
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    return failed ? 1 : 0;
+}
@@ -4,20 +4,70 @@
  * It is intended for use with proxy.c
  *
  * To implement the cache a doubly linked cache is used. See cache.h for more
+ *
+ * A single lock protects the list. Objects that are evicted while someone
+ * still holds a reference leave the list right away, so they no longer count
+ * towards the cache size, and are freed by whoever gives back the last
+ * reference.
  */
 
+#define _GNU_SOURCE
+
 #include "cache.h"
 #include "csapp.h"
+#include "metrics.h"
+#include "options.h"
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+cache_opts_t cache_opts = {
+    .ttl = 60,
+    .stale_while_revalidate = 30,
+    .stale_if_error = 600,
+    .negative_ttl = 10,
+    .error_ttl = 0,
+    .unreachable_ttl = 5,
+};
+
+static const option_t options[] = {
+    {"ttl", false, &cache_opts.ttl, "Seconds an object stays fresh"},
+    {"stale_while_revalidate", false, &cache_opts.stale_while_revalidate,
+     "Seconds a stale object is served while it is refreshed"},
+    {"stale_if_error", false, &cache_opts.stale_if_error,
+     "Seconds a stale object is served if the server is down"},
+    {"negative_ttl", false, &cache_opts.negative_ttl,
+     "Seconds a 404 or similar error stays fresh"},
+    {"error_ttl", false, &cache_opts.error_ttl,
+     "Seconds a 5xx error stays fresh, 0 to not cache it"},
+    {"unreachable_ttl", false, &cache_opts.unreachable_ttl,
+     "Seconds an unreachable host is not tried again"},
+};
 
 // global cache variable
 cache_t *cache = NULL;
 
+/* Sets the option described by spec, of the form "name=value" */
+int cache_parse(const char *spec) {
+    return options_parse(options, NUM_OPTIONS(options), spec, INT_MAX);
+}
+
+/* Prints the names and meaning of all options to stdout */
+void cache_usage(void) {
+    options_usage(options, NUM_OPTIONS(options));
+}
+
 /* returns the size of current cached data */
 size_t get_cache_size() {
-    return cache->size;
+    pthread_mutex_lock(&cache->lock);
+    size_t size = cache->size;
+    pthread_mutex_unlock(&cache->lock);
+    return size;
 }
 
 /* returns the maximum cache size */
@@ -25,112 +75,321 @@ size_t get_max_cache_size() {
     return MAX_CACHE_SIZE;
 }
 
+/* frees obj and everything it holds */
+static void free_obj(obj_t *obj) {
+    free(obj->key);
+    free(obj->buf);
+    free(obj);
+}
+
+/* Takes obj out of the cache, freeing it unless someone still holds a
+ * reference to it. The lock must be held
+ */
+static void drop_obj(obj_t *obj) {
+    if (obj->prev != NULL) {
+        obj->prev->next = obj->next;
+    } else {
+        cache->start = obj->next;
+    }
+    if (obj->next != NULL) {
+        obj->next->prev = obj->prev;
+    } else {
+        cache->end = obj->prev;
+    }
+    cache->size -= obj->size;
+
+    obj->evicted = true;
+    if (obj->ref == 0) {
+        free_obj(obj);
+    }
+}
+
+/* Gives back a reference to obj. The lock must be held */
+static void release(obj_t *obj) {
+    obj->ref -= 1;
+    if (obj->evicted && obj->ref == 0) {
+        free_obj(obj);
+    }
+}
+
 /* decreases the ref count of obj. MUST be called if a user finishes with an obj
  *
  * Should only be called if a user will not use obj again until another call
  * to get_obj
  */
 void done_with(obj_t *obj) {
-    obj->ref -= 1;
+    pthread_mutex_lock(&cache->lock);
+    release(obj);
+    pthread_mutex_unlock(&cache->lock);
 }
 
-/* Checks the cache for the LRU object, and removes it to make space for another
+/* Removes the LRU object to make space for another. The lock must be held
  *
- * This will not evict a object if the reference count is more than 0, and
- * will hang until it can remove it
+ * An object that is still referenced leaves the cache all the same, and is
+ * freed once its last reference is given back
  */
-void evict() {
+static void evict() {
     // because of our implemtation, we know that the LRU object is the last one
-    obj_t *to_leave = cache->end;
+    drop_obj(cache->end);
+    metrics_count(METRIC_CACHE_EVICTIONS, 1);
+}
 
-    // if we have a ref to the object, we cant evict yet, so recurse
-    if (to_leave->ref > 0) {
-        evict();
+/* moves a object in the cache to the front of the linked list
+ *
+ * obj must be in the cache already, and the lock must be held
+ */
+static void move_to_front(obj_t *obj) {
+    // if we are already at the front there is nothing to do
+    if (cache->start == obj) {
         return;
     }
 
-    // remove the object from the cache
-    if (cache->start == cache->end) {
-        cache->start = NULL;
-        cache->end = NULL;
+    // unlink obj, which has a prev since it is not the start
+    obj->prev->next = obj->next;
+    if (obj->next != NULL) {
+        obj->next->prev = obj->prev;
     } else {
-        cache->end = to_leave->prev;
+        cache->end = obj->prev;
     }
 
-    // update cache size
-    cache->size -= to_leave->size;
+    obj->prev = NULL;
+    obj->next = cache->start;
+    cache->start->prev = obj;
+    cache->start = obj;
+}
 
-    // free memory
-    free(to_leave->key);
-    free(to_leave->buf);
-    free(to_leave);
+/* Returns the object with a matching key, or NULL if none. The lock must be
+ * held
+ */
+static obj_t *find_obj(const char *key) {
+    // traverse the cache to find a matchign key and obj_t
+    for (obj_t *curr = cache->start; curr != NULL; curr = curr->next) {
+        // if the keys are equal then we found the obj
+        if (strcmp(curr->key, key) == 0) {
+            return curr;
+        }
+    }
+    return NULL;
 }
 
-/* moves a object in the cache to the front of the linked list
- *
- * obj must be in the cache already
+/* Finds an object with a matching key that may still be served at time now,
+ * and takes a reference to it. Returns NULL if none
  */
-void move_to_front(obj_t *obj) {
-    // if there is only one element we are already at front, or at front already
-    if (cache->start == cache->end || cache->start == obj) {
-        return;
-    } else if (cache->end == obj) { // if we are at the end
-        cache->end = obj->prev;
-        cache->end->next = NULL;
-        obj->prev = NULL;
-        obj->next = cache->start;
-        cache->start->prev = obj;
-        cache->start = obj;
-    } else { // if obj is not the start or the end
-        obj->prev->next = obj->next;
-        obj->next->prev = obj->prev;
-        obj->prev = NULL;
-        obj->next = cache->start;
-        cache->start->prev = obj;
-        cache->start = obj;
+static obj_t *lookup(const char *key, uint64_t now) {
+    pthread_mutex_lock(&cache->lock);
+    obj_t *found = find_obj(key);
+    if (found != NULL && now >= found->stale_until &&
+        now >= found->error_until) {
+        drop_obj(found);
+        found = NULL;
     }
+    if (found != NULL) {
+        // move to the front of the list, and increase ref count
+        move_to_front(found);
+        found->ref += 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
 }
 
 /* Finds an object in the cache with a matching key. Returns NULL if none
  *
  * This returns an obj_t, not the buf, so that the user can decrease ref count
- * when they are done using it
+ * when they are done using it. Objects that are past every lifetime are
+ * dropped instead. Objects that may only be served on error are returned, but
+ * counted as misses
  *
  * requires that cache_init has been called previously
  */
-obj_t *get_obj(char *key) {
-    // traverse the cache to find a matchign key and obj_t
-    for (obj_t *curr = cache->start; curr != cache->end; curr = curr->next) {
-        // if the keys are equal then we found the obj
-        if (strcmp(curr->key, key) == 0) {
-            // move to the front of the list
-            move_to_front(curr);
+obj_t *get_obj(const char *key, uint64_t now) {
+    obj_t *found = lookup(key, now);
+    bool hit = found != NULL && now < found->stale_until;
+    metrics_count(hit ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, 1);
+    return found;
+}
+
+/* Returns true if an object with a matching key is fresh at time now
+ *
+ * Unlike get_obj, this neither counts as a hit or miss nor moves the object
+ * to the front, so looking ahead does not skew the metrics or the LRU order
+ */
+bool cache_fresh(const char *key, uint64_t now) {
+    pthread_mutex_lock(&cache->lock);
+    obj_t *found = find_obj(key);
+    bool fresh = found != NULL && now < found->fresh_until;
+    pthread_mutex_unlock(&cache->lock);
+    return fresh;
+}
+
+/* Returns how obj may be used at time now */
+cache_state obj_state(const obj_t *obj, uint64_t now) {
+    if (now < obj->fresh_until) {
+        return CACHE_FRESH;
+    }
+    if (now < obj->stale_until) {
+        return CACHE_STALE;
+    }
+    return CACHE_ERROR_ONLY;
+}
 
-            // increase ref count
-            curr->ref += 1;
+/* Claims the refresh of the stale object obj */
+bool claim_refresh(obj_t *obj) {
+    pthread_mutex_lock(&cache->lock);
+    bool claimed = !obj->refreshing && !obj->evicted;
+    if (claimed) {
+        obj->refreshing = true;
+        obj->ref += 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return claimed;
+}
 
-            return curr;
+/* Ends a refresh claimed with claim_refresh */
+void refresh_done(obj_t *obj) {
+    pthread_mutex_lock(&cache->lock);
+    obj->refreshing = false;
+    release(obj);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Returns the value of the directive "name=value" that starts at p, in
+ * seconds, or -1 if it is not a number
+ */
+static long directive_value(const char *p, const char *end) {
+    const char *eq = memchr(p, '=', end - p);
+    if (eq == NULL || eq + 1 == end || !isdigit((unsigned char)eq[1])) {
+        return -1;
+    }
+    long value = 0;
+    for (p = eq + 1; p < end && isdigit((unsigned char)*p); p++) {
+        value = value < INT_MAX / 10 ? value * 10 + *p - '0' : INT_MAX;
+    }
+    return value;
+}
+
+/* Applies the Cache-Control header value between p and end to the lifetimes
+ * at life, as ttl, stale_while_revalidate and stale_if_error
+ *
+ * Returns false if the response must not be cached
+ */
+static bool cache_control(const char *p, const char *end, long life[3]) {
+    long s_maxage = -1;
+    while (p < end) {
+        while (p < end && (isspace((unsigned char)*p) || *p == ',')) {
+            p++;
+        }
+        const char *dir = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+
+        // "no-store ," has to match no-store just like "no-store,"
+        const char *dir_end = p;
+        while (dir_end > dir && isspace((unsigned char)dir_end[-1])) {
+            dir_end--;
+        }
+        size_t len = dir_end - dir;
+        long value = directive_value(dir, dir_end);
+        if ((len == 8 && strncasecmp(dir, "no-store", len) == 0) ||
+            (len == 7 && strncasecmp(dir, "private", len) == 0)) {
+            return false;
+        } else if (len == 8 && strncasecmp(dir, "no-cache", len) == 0) {
+            life[0] = 0;
+            life[1] = 0;
+        } else if (strncasecmp(dir, "max-age=", 8) == 0 && value >= 0) {
+            life[0] = value;
+        } else if (strncasecmp(dir, "s-maxage=", 9) == 0 && value >= 0) {
+            s_maxage = value;
+        } else if (strncasecmp(dir, "stale-while-revalidate=", 23) == 0 &&
+                   value >= 0) {
+            life[1] = value;
+        } else if (strncasecmp(dir, "stale-if-error=", 15) == 0 &&
+                   value >= 0) {
+            life[2] = value;
         }
     }
 
-    // if nothing was found, return NULL
-    return NULL;
+    // a shared cache goes by s-maxage over max-age
+    if (s_maxage >= 0) {
+        life[0] = s_maxage;
+    }
+    return true;
 }
 
-/* Adds a object to the cache
+/* Works out the lifetimes of the response in the n bytes at buf, as ttl,
+ * stale_while_revalidate and stale_if_error, into life, and its status code
+ * into *status
  *
- * Stores the pointer to the object, not the ojects data itself
- * If adding this object would cause the cache to exceed MAX_CACHE_SIZE, then
- * it will call evict() to make room
+ * Returns false if the response must not be cached
+ */
+static bool freshness(const char *buf, size_t n, long life[3], int *status) {
+    // only complete responses
+    const char *headers_end = memmem(buf, n, "\r\n\r\n", 4);
+    if (headers_end == NULL || n < 12 || strncmp(buf, "HTTP/1.", 7) != 0) {
+        return false;
+    }
+
+    // statuses that may be cached by default (RFC 7231, section 6.1), with
+    // the errors among them only cached briefly, plus 5xx errors if enabled
+    *status = atoi(buf + 9);
+    switch (*status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+        life[0] = cache_opts.ttl;
+        life[1] = cache_opts.stale_while_revalidate;
+        life[2] = cache_opts.stale_if_error;
+        break;
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        life[0] = cache_opts.negative_ttl;
+        life[1] = 0;
+        life[2] = 0;
+        break;
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+        if (cache_opts.error_ttl == 0) {
+            return false;
+        }
+        life[0] = cache_opts.error_ttl;
+        life[1] = 0;
+        life[2] = 0;
+        break;
+    default:
+        return false;
+    }
+
+    // go through the header lines, after the status line
+    const char *line = memchr(buf, '\n', headers_end + 2 - buf) + 1;
+    while (line < headers_end) {
+        const char *eol = memchr(line, '\r', headers_end + 2 - line);
+        if (eol - line > 14 && strncasecmp(line, "Cache-Control:", 14) == 0 &&
+            !cache_control(line + 14, eol, life)) {
+            return false;
+        }
+        line = eol + 2;
+    }
+    return true;
+}
+
+/* Adds an object with the lifetimes at life (see freshness) to the cache,
+ * replacing any object with the same key if replace is set
  *
- * The size of the object must be less thatn MAX_OBJECT_SIZE
- * cache_init must be called before any call to add_obj
+ * Returns true if it was added, or false if replace is not set and there
+ * already is an object with the same key
  */
-void add_obj(char *key, char *buf, size_t buf_size) {
-    // check if adding object would exceed MAX_CACHE_SIZE, if so make room
-    for (size_t curr_size = cache->size; curr_size + buf_size > MAX_CACHE_SIZE;
-         curr_size = cache->size) {
-        evict();
+static bool insert(char *key, char *buf, size_t buf_size, uint64_t now,
+                   const long life[3], bool replace) {
+    // an object that can never fit would evict everything and still not fit
+    if (buf_size > MAX_CACHE_SIZE) {
+        return false;
     }
 
     // allocate space for new object
@@ -141,6 +400,29 @@ void add_obj(char *key, char *buf, size_t buf_size) {
     new->key = key;
     new->ref = 0;
     new->size = buf_size;
+    new->fresh_until = now + life[0] * NSEC_PER_SEC;
+    new->stale_until = new->fresh_until + life[1] * NSEC_PER_SEC;
+    new->error_until = new->fresh_until + life[2] * NSEC_PER_SEC;
+    new->refreshing = false;
+    new->evicted = false;
+
+    pthread_mutex_lock(&cache->lock);
+
+    // the new object replaces any older one
+    obj_t *old = find_obj(key);
+    if (old != NULL && !replace) {
+        pthread_mutex_unlock(&cache->lock);
+        free(new);
+        return false;
+    }
+    if (old != NULL) {
+        drop_obj(old);
+    }
+
+    // check if adding object would exceed MAX_CACHE_SIZE, if so make room
+    while (cache->size + buf_size > MAX_CACHE_SIZE) {
+        evict();
+    }
 
     // check to see if cache is empty, if so add new
     if (cache->start == NULL && cache->end == NULL) {
@@ -154,6 +436,65 @@ void add_obj(char *key, char *buf, size_t buf_size) {
 
     // increase size of data stored by cache
     cache->size += buf_size;
+
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+/* Adds a object to the cache
+ *
+ * Stores the pointer to the object, not the ojects data itself
+ * If adding this object would cause the cache to exceed MAX_CACHE_SIZE, then
+ * it will call evict() to make room
+ *
+ * The size of the object must be less thatn MAX_OBJECT_SIZE
+ * cache_init must be called before any call to add_obj
+ */
+bool add_obj(char *key, char *buf, size_t buf_size, uint64_t now) {
+    long life[3];
+    int status;
+    if (buf_size > MAX_OBJECT_SIZE ||
+        !freshness(buf, buf_size, life, &status)) {
+        return false;
+    }
+    return insert(key, buf, buf_size, now, life, status < 500);
+}
+
+/* Returns the key under which the error for host:port is kept */
+static char *host_key(const char *host, const char *port) {
+    size_t len = strlen(host) + strlen(port) + 16;
+    char *key = Malloc(len);
+    snprintf(key, len, "unreachable://%s:%s", host, port);
+    return key;
+}
+
+/* Remembers the error response for host:port, which could not be reached */
+bool add_host_error(const char *host, const char *port, char *buf,
+                    size_t buf_size, uint64_t now) {
+    long life[3] = {cache_opts.unreachable_ttl, 0, 0};
+    if (life[0] == 0 || buf_size > MAX_OBJECT_SIZE) {
+        return false;
+    }
+
+    char *key = host_key(host, port);
+    if (!insert(key, buf, buf_size, now, life, true)) {
+        free(key);
+        return false;
+    }
+    return true;
+}
+
+/* Finds the error response for host:port, if it is still fresh */
+obj_t *get_host_error(const char *host, const char *port, uint64_t now) {
+    char *key = host_key(host, port);
+    obj_t *found = lookup(key, now);
+    free(key);
+
+    if (found != NULL && obj_state(found, now) != CACHE_FRESH) {
+        done_with(found);
+        found = NULL;
+    }
+    return found;
 }
 
 /* Initializes the cache object
@@ -166,4 +507,5 @@ void cache_init() {
     cache->start = NULL;
     cache->end = NULL;
     cache->size = 0;
+    pthread_mutex_init(&cache->lock, NULL);
 }
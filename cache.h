@@ -8,13 +8,61 @@
  * Each object in the cache has max size MAX_OBJECT_SIZE
  * The maximum cache size is MAX_CACHE_SIZE
  *
+ * Objects are whole HTTP responses, and age as described by RFC 5861:
+ *  - while fresh, an object is served as is
+ *  - for stale_while_revalidate seconds after that, it is still served, but
+ *    whoever gets it first refreshes it in the background (see claim_refresh)
+ *  - for stale_if_error seconds after it stops being fresh, it may only be
+ *    served if the server cannot be reached
+ * The lifetimes come from the Cache-Control header of the response, or from
+ * cache_opts when it has none. Error responses are cached too, but only for
+ * the short negative_ttl (404, 410 and the like) or error_ttl (5xx, off by
+ * default), and are never served stale. A 5xx response never replaces an
+ * object that is already cached, since that object is better than nothing.
+ *
+ * The cache also remembers, per host, the error served when a host could not
+ * be reached, so it is not tried again for unreachable_ttl seconds.
+ *
+ * All functions are thread safe.
  */
 
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-// max cache and cache object size
+// max cache and cache object size. bench/cachesim builds cache.c with
+// other limits to compare them
+#ifndef MAX_CACHE_SIZE
 #define MAX_CACHE_SIZE (1024 * 1024)
+#endif
+#ifndef MAX_OBJECT_SIZE
 #define MAX_OBJECT_SIZE (100 * 1024)
+#endif
+
+/* Type for the default lifetimes of objects, all in seconds
+ *
+ * ttl is how long an object stays fresh
+ * stale_while_revalidate is how long it is served while being refreshed
+ * stale_if_error is how long it is served when the server is unreachable
+ * negative_ttl is how long 4xx responses, and 501, stay fresh
+ * error_ttl is how long 5xx responses stay fresh, 0 to not cache them
+ * unreachable_ttl is how long a host that could not be reached is given up on
+ */
+typedef struct {
+    int ttl;
+    int stale_while_revalidate;
+    int stale_if_error;
+    int negative_ttl;
+    int error_ttl;
+    int unreachable_ttl;
+} cache_opts_t;
+
+/* How an object may be used, see obj_state */
+typedef enum { CACHE_FRESH, CACHE_STALE, CACHE_ERROR_ONLY } cache_state;
 
 /* Type for each cache object
  *
@@ -24,6 +72,11 @@
  * buf is the data held by the cache
  * ref is how many thread current hold a reference to buf
  * size is the size of the object
+ * fresh_until, stale_until and error_until are the times (see metrics.h) at
+ * which the object stops being fresh, servable while stale, and servable on
+ * error
+ * refreshing is set while a refresh of the object is underway
+ * evicted is set once it has left the cache, and is freed with its last ref
  */
 typedef struct object {
     struct object *next;
@@ -32,6 +85,11 @@ typedef struct object {
     char *buf;
     int ref;
     size_t size;
+    uint64_t fresh_until;
+    uint64_t stale_until;
+    uint64_t error_until;
+    bool refreshing;
+    bool evicted;
 } obj_t;
 
 /* Type for the cache
@@ -41,9 +99,92 @@ typedef struct object {
  * start is the beginning of the list
  * end is the end of the list
  * size is the current size of the cache data, not counting keys and structures
+ * lock protects all of the above, and the refs of the objects
  */
 typedef struct {
     obj_t *start;
     obj_t *end;
     size_t size;
+    pthread_mutex_t lock;
 } cache_t;
+
+/* The default lifetimes in use */
+extern cache_opts_t cache_opts;
+
+/* Sets the option described by spec, of the form "name=value"
+ *
+ * Returns 0 on success, or -1 if spec does not name a known option
+ */
+int cache_parse(const char *spec);
+
+/* Prints the names and meaning of all options to stdout */
+void cache_usage(void);
+
+/* Initializes the cache object
+ *
+ * Must be called before any other function is called
+ */
+void cache_init(void);
+
+/* returns the size of current cached data */
+size_t get_cache_size(void);
+
+/* returns the maximum cache size */
+size_t get_max_cache_size(void);
+
+/* Finds an object in the cache with a matching key, that may still be
+ * served at time now. Returns NULL if none
+ *
+ * The object must be given back with done_with
+ */
+obj_t *get_obj(const char *key, uint64_t now);
+
+/* Returns true if an object with a matching key is fresh at time now. This
+ * does not count as a hit or a miss
+ */
+bool cache_fresh(const char *key, uint64_t now);
+
+/* Returns how obj may be used at time now */
+cache_state obj_state(const obj_t *obj, uint64_t now);
+
+/* decreases the ref count of obj. MUST be called if a user finishes with an obj
+ */
+void done_with(obj_t *obj);
+
+/* Claims the refresh of the stale object obj
+ *
+ * Returns true if the caller should refresh it, in which case it holds a
+ * reference of its own until it calls refresh_done, or false if someone else
+ * is already at it
+ */
+bool claim_refresh(obj_t *obj);
+
+/* Ends a refresh claimed with claim_refresh, whether it succeeded or not */
+void refresh_done(obj_t *obj);
+
+/* Adds the response in the buf_size bytes at buf to the cache under key,
+ * replacing any object with the same key
+ *
+ * Returns true if it was added, in which case the cache owns key and buf, or
+ * false if the response may not be cached
+ */
+bool add_obj(char *key, char *buf, size_t buf_size, uint64_t now);
+
+/* Remembers the buf_size bytes at buf as the error response for host:port,
+ * which could not be reached at time now
+ *
+ * Returns true if it was added, in which case the cache owns buf, or false
+ * if unreachable hosts are not remembered
+ */
+bool add_host_error(const char *host, const char *port, char *buf,
+                    size_t buf_size, uint64_t now);
+
+/* Finds the error response for host:port, if it could not be reached less
+ * than unreachable_ttl seconds before now. Returns NULL if none
+ *
+ * This does not count as a hit or a miss. The object must be given back with
+ * done_with
+ */
+obj_t *get_host_error(const char *host, const char *port, uint64_t now);
+
+#endif /* CACHE_H */
@@ -0,0 +1,283 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the Happy Eyeballs connector used by proxy.c
+ *
+ * Attempts and the timer live in a small epoll instance of their own, which
+ * is only created once an attempt turns out not to finish right away. A
+ * server with a single working address never needs it.
+ *
+ * With TCP Fast Open (see sockopt.h) connect returns 0 before the handshake
+ * has even started, so the first address would always win without being
+ * tried. Fast Open is therefore only used for servers with a single address,
+ * where there is no race to lose, and a failed connect shows up on the first
+ * write instead.
+ *
+ * See connector.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "connector.h"
+#include "csapp.h"
+#include "sockopt.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// epoll data of the timer, attempts use their index instead
+#define TIMER_MARKER UINT32_MAX
+
+/* Type for the state of a connector
+ *
+ * conn is the public part, and must come first
+ * timerfd fires when the next attempt is due or the connect times out
+ * addrs holds the naddrs addresses to try, in the order they are tried
+ * fds holds the socket of every attempt underway, or -1
+ * next is the index of the next address to try
+ * pending is the number of attempts underway
+ * next_start and deadline are times in milliseconds, see now_ms
+ * winner is a socket that connected right away, or -1
+ * error is the errno of the last attempt that failed
+ */
+typedef struct {
+    connector_t conn;
+    int timerfd;
+    struct addrinfo *addrs[CONNECT_MAX_ADDRS];
+    int fds[CONNECT_MAX_ADDRS];
+    size_t naddrs;
+    size_t next;
+    size_t pending;
+    int64_t next_start;
+    int64_t deadline;
+    int winner;
+    int error;
+} race_t;
+
+/* Returns the current monotonic time in milliseconds */
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Puts up to CONNECT_MAX_ADDRS of addrs into race->addrs, alternating
+ * between the family of the first address and all other families
+ */
+static void order_addrs(race_t *race, struct addrinfo *addrs) {
+    struct addrinfo *first[CONNECT_MAX_ADDRS];
+    struct addrinfo *other[CONNECT_MAX_ADDRS];
+    size_t nfirst = 0;
+    size_t nother = 0;
+
+    for (struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == addrs->ai_family) {
+            if (nfirst < CONNECT_MAX_ADDRS) {
+                first[nfirst++] = ai;
+            }
+        } else if (nother < CONNECT_MAX_ADDRS) {
+            other[nother++] = ai;
+        }
+    }
+
+    size_t i = 0;
+    size_t j = 0;
+    while (race->naddrs < CONNECT_MAX_ADDRS && (i < nfirst || j < nother)) {
+        if (i < nfirst) {
+            race->addrs[race->naddrs++] = first[i++];
+        }
+        if (j < nother && race->naddrs < CONNECT_MAX_ADDRS) {
+            race->addrs[race->naddrs++] = other[j++];
+        }
+    }
+}
+
+/* Creates a connector for the addresses in addrs, giving up after
+ * timeout_ms
+ */
+connector_t *connector_new(struct addrinfo *addrs, unsigned timeout_ms) {
+    race_t *race = Calloc(1, sizeof(race_t));
+    race->conn.connfd = -1;
+    race->timerfd = -1;
+    race->winner = -1;
+    race->error = EHOSTUNREACH;
+    race->deadline = timeout_ms > 0 ? now_ms() + timeout_ms : INT64_MAX;
+    for (size_t i = 0; i < CONNECT_MAX_ADDRS; i++) {
+        race->fds[i] = -1;
+    }
+    order_addrs(race, addrs);
+    return &race->conn;
+}
+
+/* Creates the epoll instance and timer used to wait for attempts
+ *
+ * Returns 0 on success, or -1 on error
+ */
+static int start_watching(race_t *race) {
+    if (race->conn.connfd >= 0) {
+        return 0;
+    }
+
+    race->conn.connfd = epoll_create1(EPOLL_CLOEXEC);
+    race->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (race->conn.connfd < 0 || race->timerfd < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = TIMER_MARKER;
+    return epoll_ctl(race->conn.connfd, EPOLL_CTL_ADD, race->timerfd, &ev);
+}
+
+/* Starts an attempt to connect to the next address. If it connects right
+ * away, the socket becomes the winner
+ */
+static void start_attempt(race_t *race) {
+    size_t idx = race->next++;
+    struct addrinfo *ai = race->addrs[idx];
+
+    int fd = sockopt_socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol,
+                            race->naddrs == 1);
+    if (fd < 0) {
+        race->error = errno;
+        return;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        race->winner = fd;
+        return;
+    }
+    if (errno != EINPROGRESS || start_watching(race) < 0) {
+        race->error = errno;
+        close(fd);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.u32 = idx;
+    if (epoll_ctl(race->conn.connfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        race->error = errno;
+        close(fd);
+        return;
+    }
+    race->fds[idx] = fd;
+    race->pending += 1;
+    race->next_start = now_ms() + CONNECT_DELAY_MS;
+}
+
+/* Collects the attempts that have finished. The first one to succeed
+ * becomes the winner, and the ones that failed are closed
+ */
+static void reap_attempts(race_t *race) {
+    struct epoll_event events[CONNECT_MAX_ADDRS + 1];
+    int n = epoll_wait(race->conn.connfd, events, CONNECT_MAX_ADDRS + 1, 0);
+
+    for (int i = 0; i < n && race->winner < 0; i++) {
+        uint32_t idx = events[i].data.u32;
+        if (idx == TIMER_MARKER) {
+            uint64_t expirations;
+            if (read(race->timerfd, &expirations, sizeof(expirations)) < 0 &&
+                errno != EAGAIN) {
+                perror("timerfd read");
+            }
+            continue;
+        }
+
+        int fd = race->fds[idx];
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+
+        race->fds[idx] = -1;
+        race->pending -= 1;
+        epoll_ctl(race->conn.connfd, EPOLL_CTL_DEL, fd, NULL);
+        if (err == 0) {
+            race->winner = fd;
+        } else {
+            race->error = err;
+            close(fd);
+        }
+    }
+}
+
+/* Sets the timer to fire at the time at, in milliseconds */
+static void arm_timer(race_t *race, int64_t at) {
+    // a zero time disarms the timer, when there is nothing to wait for
+    struct itimerspec its = {0};
+    if (at != INT64_MAX) {
+        its.it_value.tv_sec = at / 1000;
+        its.it_value.tv_nsec = (at % 1000) * 1000000;
+    }
+    timerfd_settime(race->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Makes progress on connecting */
+int connector_poll(connector_t *conn) {
+    race_t *race = (race_t *)conn;
+
+    if (race->conn.connfd >= 0) {
+        reap_attempts(race);
+    }
+
+    // start the next attempt when it is due, or at once if nothing else is
+    // underway, until one of them wins
+    while (race->winner < 0 && race->next < race->naddrs &&
+           (race->pending == 0 || now_ms() >= race->next_start)) {
+        start_attempt(race);
+    }
+
+    if (race->winner >= 0) {
+        int fd = race->winner;
+        race->winner = -1;
+        return fd;
+    }
+    if (race->pending == 0) {
+        errno = race->error;
+        return -1;
+    }
+    if (now_ms() >= race->deadline) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    bool more = race->next < race->naddrs;
+    arm_timer(race, more && race->next_start < race->deadline
+                        ? race->next_start
+                        : race->deadline);
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Frees conn, abandoning every attempt still underway */
+void connector_free(connector_t *conn) {
+    if (conn == NULL) {
+        return;
+    }
+
+    race_t *race = (race_t *)conn;
+    for (size_t i = 0; i < race->naddrs; i++) {
+        if (race->fds[i] >= 0) {
+            close(race->fds[i]);
+        }
+    }
+    if (race->winner >= 0) {
+        close(race->winner);
+    }
+    if (race->timerfd >= 0) {
+        close(race->timerfd);
+    }
+    if (race->conn.connfd >= 0) {
+        close(race->conn.connfd);
+    }
+    free(race);
+}
@@ -0,0 +1,61 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for connector.c
+ *
+ * These files implement the non-blocking connector proxy.c uses to reach
+ * servers. Instead of trying the addresses of a server one by one, each
+ * blocking until it times out, it races them as described by RFC 8305
+ * ("Happy Eyeballs"):
+ *  - the addresses are reordered to alternate between IPv6 and IPv4, so a
+ *    broken address family costs at most one attempt
+ *  - the next address is tried CONNECT_DELAY_MS after the previous attempt
+ *    started, or right away if that attempt failed, while earlier attempts
+ *    keep going
+ *  - the first attempt to succeed wins, and the others are abandoned
+ *  - if nothing has succeeded by the timeout given to connector_new, the
+ *    connect fails
+ *
+ * A connector is driven like the readers in nbio.h: connector_poll fails
+ * with EAGAIN until there is a result, and the caller waits for connfd to
+ * become readable in between. connfd is a private epoll instance watching
+ * all attempts plus a timer, so a task only ever waits on one descriptor.
+ */
+
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <netdb.h>
+
+// delay before starting the next attempt, the RFC 8305 recommended value
+#define CONNECT_DELAY_MS 250
+
+// most addresses of a server that are tried
+#define CONNECT_MAX_ADDRS 16
+
+/* Type for a connector
+ *
+ * connfd is the descriptor to wait on for readability while connecting, or
+ * -1 as long as nothing needs to be waited for
+ */
+typedef struct connector {
+    int connfd;
+} connector_t;
+
+/* Creates a connector for the addresses in addrs, which may be NULL. addrs
+ * must stay valid until the connector is freed. The connect gives up after
+ * timeout_ms milliseconds, or never if it is 0
+ */
+connector_t *connector_new(struct addrinfo *addrs, unsigned timeout_ms);
+
+/* Makes progress on connecting
+ *
+ * Returns a connected non-blocking socket, which belongs to the caller, or -1
+ * on error. Fails with EAGAIN while attempts are still underway, in which
+ * case the caller should wait until connfd is readable and call it again
+ */
+int connector_poll(connector_t *conn);
+
+/* Frees conn, abandoning every attempt still underway */
+void connector_free(connector_t *conn);
+
+#endif /* CONNECTOR_H */
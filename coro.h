@@ -0,0 +1,62 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of macros for writing stackless coroutines in the style
+ * of protothreads
+ *
+ * A coroutine is an ordinary function whose body sits between CO_BEGIN and
+ * CO_END. It returns CO_WAIT whenever it has to wait for something, and the
+ * next call to the function resumes right after the point where it left off.
+ * The resume point is kept in an int, which must start out as 0.
+ *
+ * CO_BEGIN must come before any statement of the body, and every variable
+ * the body uses must be declared before it.
+ *
+ * Because the body is one big switch statement, two rules apply:
+ *  - local variables do not survive a wait, so anything needed afterwards
+ *    must live in the coroutine's own state struct
+ *  - a switch statement in the body must not contain a wait
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+// return values of a coroutine function
+#define CO_DONE 0
+#define CO_WAIT 1
+
+/* Starts the body of a coroutine, jumping to the saved resume point */
+#define CO_BEGIN(line)                                                         \
+    switch (line) {                                                            \
+    case 0:
+
+/* Ends the body of a coroutine
+ *
+ * line is left alone, since a coroutine that frees its own state when it
+ * finishes must not have it written afterwards. A finished coroutine must
+ * not be called again
+ */
+#define CO_END(line)                                                           \
+    }                                                                          \
+    return CO_DONE
+
+/* Saves the current position, and returns CO_WAIT. The next call resumes
+ * execution right after the macro
+ */
+#define CO_YIELD(line)                                                         \
+    do {                                                                       \
+        (line) = __LINE__;                                                     \
+        return CO_WAIT;                                                        \
+    case __LINE__:;                                                            \
+    } while (0)
+
+/* Waits until cond is true, checking it again each time it is resumed */
+#define CO_AWAIT(line, cond)                                                   \
+    do {                                                                       \
+        (line) = __LINE__;                                                     \
+    case __LINE__:                                                             \
+        if (!(cond)) {                                                         \
+            return CO_WAIT;                                                    \
+        }                                                                      \
+    } while (0)
+
+#endif /* CORO_H */
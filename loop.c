@@ -0,0 +1,545 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the event loops used by proxy.c
+ *
+ * Every loop waits on its own epoll instance. Descriptors are watched with
+ * EPOLLONESHOT on behalf of a single task, so a wakeup always belongs to
+ * exactly one waiting task, which is then put on the loop's run queue.
+ *
+ * The run queues are per loop, and each loop is pinned to its own core when
+ * the proxy is allowed to run on enough of them. A loop runs tasks from the
+ * front of its own queue, and queues new ones at the back. A loop that runs
+ * out of work steals half of the longest queue of another loop from its back
+ * end, so the victim keeps the tasks that have waited longest and runs them
+ * next, while the thief takes the ones that would have waited longest there.
+ * Loops with a long queue wake an idle loop up so it can come and steal. A
+ * stolen task simply waits on the thief's epoll instance from then on.
+ *
+ * Timers live in a hashed timing wheel: a timer goes into the slot of the
+ * first tick at or after its expiry, and every tick the loop walks the slots
+ * that have come due. Timers further out than a full turn of the wheel just
+ * stay in their slot until a later turn. Starting and stopping a timer is
+ * O(1), which matters because every connection has one. A timer stays on
+ * the wheel it was started on even if its task is stolen, so the wheel has a
+ * lock of its own, which timer_stop takes to wait out a running timer
+ * function. Loops only wake up for ticks while they have timers.
+ *
+ * When accepting fails for lack of descriptors or memory, the connection
+ * stays queued and the listening socket stays readable, so a loop stops
+ * watching it for ACCEPT_BACKOFF_MS rather than spin on it.
+ *
+ * See loop.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "loop.h"
+#include "csapp.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// most events handled per epoll_wait
+#define MAX_EVENTS 256
+
+// queue length at which a loop wakes an idle loop up to steal from it
+#define STEAL_THRESHOLD 2
+
+// slots in a timer wheel, and the time each of them covers in ms
+#define WHEEL_SLOTS 512
+#define WHEEL_TICK_MS 100
+
+// time a loop stops accepting for after running out of descriptors
+#define ACCEPT_BACKOFF_MS 100
+
+/* Type for an event loop
+ *
+ * epfd is the epoll instance of the loop
+ * efd is an eventfd used to wake the loop up
+ * idle is set while the loop is sleeping with nothing to run
+ * incoming holds tasks spawned by other threads
+ * tasks is the run queue, a circular array of cap entries holding len tasks
+ * from index head onwards. Other loops steal from it, so it is protected by
+ * lock just like incoming
+ * wheel is the timer wheel, holding ntimers timers, with wheel_tick the next
+ * tick to run. It is protected by timer_lock
+ * accept_paused is the time until which the loop does not watch the
+ * listening socket, or 0 while it does
+ * cpu is the CPU the loop is pinned to, or -1
+ */
+struct loop {
+    int epfd;
+    int efd;
+    int idle;
+    pthread_mutex_t lock;
+    task_t *incoming;
+    task_t **tasks;
+    size_t cap;
+    size_t head;
+    size_t len;
+    pthread_mutex_t timer_lock;
+    loop_timer_t *wheel[WHEEL_SLOTS];
+    uint64_t wheel_tick;
+    size_t ntimers;
+    uint64_t accept_paused;
+    int cpu;
+};
+
+static loop_t *loops = NULL;
+static int num_loops = 0;
+static unsigned next_loop = 0;
+
+static int listen_fd = -1;
+static accept_fn *on_accept = NULL;
+
+// markers stored in the epoll data of the listening socket and the eventfd
+static char listen_marker;
+static char wakeup_marker;
+
+/* Wakes loop up by bumping its eventfd */
+static void wake(loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->efd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+    }
+}
+
+/* Wakes up one idle loop, if there is one, so it can steal from us */
+static void wake_idle(loop_t *self) {
+    for (int i = 0; i < num_loops; i++) {
+        loop_t *loop = &loops[i];
+        int expected = 1;
+        if (loop != self &&
+            __atomic_compare_exchange_n(&loop->idle, &expected, 0, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            wake(loop);
+            return;
+        }
+    }
+}
+
+/* Appends task to the back of the run queue of loop */
+static void push_task(loop_t *loop, task_t *task) {
+    pthread_mutex_lock(&loop->lock);
+    if (loop->len == loop->cap) {
+        // grow the circular array, unwrapping it into the new space
+        size_t cap = loop->cap * 2;
+        task_t **tasks = Malloc(cap * sizeof(task_t *));
+        for (size_t i = 0; i < loop->len; i++) {
+            tasks[i] = loop->tasks[(loop->head + i) % loop->cap];
+        }
+        free(loop->tasks);
+        loop->tasks = tasks;
+        loop->cap = cap;
+        loop->head = 0;
+    }
+    loop->tasks[(loop->head + loop->len) % loop->cap] = task;
+    loop->len += 1;
+    size_t len = loop->len;
+    pthread_mutex_unlock(&loop->lock);
+
+    if (len >= STEAL_THRESHOLD) {
+        wake_idle(loop);
+    }
+}
+
+/* Removes and returns the front task of the run queue, or NULL if empty */
+static task_t *pop_task(loop_t *loop) {
+    task_t *task = NULL;
+    pthread_mutex_lock(&loop->lock);
+    if (loop->len > 0) {
+        task = loop->tasks[loop->head];
+        loop->head = (loop->head + 1) % loop->cap;
+        loop->len -= 1;
+    }
+    pthread_mutex_unlock(&loop->lock);
+    return task;
+}
+
+/* Steals half of the run queue of the busiest other loop, taking tasks from
+ * its back end and putting them on the run queue of self
+ *
+ * Returns the number of tasks stolen
+ */
+static size_t steal(loop_t *self) {
+    // pick a victim by peeking at queue lengths without locking
+    loop_t *victim = NULL;
+    size_t most = 0;
+    for (int i = 0; i < num_loops; i++) {
+        loop_t *loop = &loops[i];
+        size_t len = __atomic_load_n(&loop->len, __ATOMIC_RELAXED);
+        if (loop != self && len > most) {
+            victim = loop;
+            most = len;
+        }
+    }
+    if (victim == NULL) {
+        return 0;
+    }
+
+    task_t *stolen[MAX_EVENTS];
+    size_t count = 0;
+    pthread_mutex_lock(&victim->lock);
+    size_t want = (victim->len + 1) / 2;
+    while (count < want && count < MAX_EVENTS) {
+        victim->len -= 1;
+        stolen[count++] =
+            victim->tasks[(victim->head + victim->len) % victim->cap];
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    // keep the order they had in the victim's queue
+    size_t taken = count;
+    while (count > 0) {
+        push_task(self, stolen[--count]);
+    }
+    return taken;
+}
+
+/* Suspends task until fd is ready for events
+ *
+ * Returns 0 on success, or -1 if fd could not be watched
+ */
+int task_wait(task_t *task, int fd, unsigned events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = task;
+
+    // rearm the descriptor, or register it if this is the first wait on it
+    if (epoll_ctl(task->loop->epfd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return 0;
+    }
+    if (errno == ENOENT &&
+        epoll_ctl(task->loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+/* Stops watching fd on behalf of task */
+void task_forget(task_t *task, int fd) {
+    epoll_ctl(task->loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Returns the current monotonic time in milliseconds */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Puts timer into the wheel of loop, which must be locked */
+static void link_timer(loop_t *loop, loop_timer_t *timer) {
+    // the first tick at or after the expiry, but never one already run
+    uint64_t tick = (timer->expires + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (tick < loop->wheel_tick) {
+        tick = loop->wheel_tick;
+    }
+
+    loop_timer_t **slot = &loop->wheel[tick % WHEEL_SLOTS];
+    timer->next = *slot;
+    timer->pprev = slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->loop = loop;
+    loop->ntimers += 1;
+}
+
+/* Takes timer out of the wheel of loop, which must be locked */
+static void unlink_timer(loop_t *loop, loop_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    loop->ntimers -= 1;
+}
+
+/* Starts timer on the loop task is running on */
+void timer_start(task_t *task, loop_timer_t *timer, unsigned ms, timer_fn *fn) {
+    timer_stop(timer);
+
+    loop_t *loop = task->loop;
+    pthread_mutex_lock(&loop->timer_lock);
+    timer->expires = now_ms() + ms;
+    timer->fn = fn;
+    link_timer(loop, timer);
+    pthread_mutex_unlock(&loop->timer_lock);
+}
+
+/* Stops timer, if it is running */
+void timer_stop(loop_timer_t *timer) {
+    // only the wheel holding the timer ever clears its loop, under its lock
+    loop_t *loop = __atomic_load_n(&timer->loop, __ATOMIC_ACQUIRE);
+    if (loop == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&loop->timer_lock);
+    if (timer->loop == loop) {
+        unlink_timer(loop, timer);
+        timer->loop = NULL;
+    }
+    pthread_mutex_unlock(&loop->timer_lock);
+}
+
+/* Calls the function of every timer of loop that has expired */
+static void run_timers(loop_t *loop) {
+    uint64_t now = now_ms();
+    uint64_t tick = now / WHEEL_TICK_MS;
+    if (tick < __atomic_load_n(&loop->wheel_tick, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&loop->timer_lock);
+
+    // after a long sleep, one turn of the wheel covers every slot
+    uint64_t first = loop->wheel_tick;
+    if (tick - first >= WHEEL_SLOTS) {
+        first = tick - WHEEL_SLOTS + 1;
+    }
+
+    // timers that want to expire again are only put back afterwards, so
+    // they cannot come up again in this same pass
+    loop_timer_t *again = NULL;
+    for (uint64_t t = first; t <= tick && loop->ntimers > 0; t++) {
+        loop_timer_t *timer = loop->wheel[t % WHEEL_SLOTS];
+        while (timer != NULL) {
+            loop_timer_t *next = timer->next;
+            if (timer->expires <= now) {
+                unlink_timer(loop, timer);
+                unsigned ms = timer->fn(timer);
+                if (ms > 0) {
+                    timer->expires = now + ms;
+                    timer->next = again;
+                    again = timer;
+                } else {
+                    __atomic_store_n(&timer->loop, NULL, __ATOMIC_RELEASE);
+                }
+            }
+            timer = next;
+        }
+    }
+    __atomic_store_n(&loop->wheel_tick, tick + 1, __ATOMIC_RELAXED);
+
+    while (again != NULL) {
+        loop_timer_t *next = again->next;
+        link_timer(loop, again);
+        again = next;
+    }
+    pthread_mutex_unlock(&loop->timer_lock);
+}
+
+/* Starts watching the listening socket on loop, with only one loop woken up
+ * for each new connection
+ */
+static void watch_listener(loop_t *loop) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listen_marker;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+/* Accepts every pending connection on the listening socket, and queues a
+ * task for each of them on loop
+ */
+static void accept_all(loop_t *loop) {
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int connfd = accept4(listen_fd, (struct sockaddr *)&addr, &addrlen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0 && (errno == EMFILE || errno == ENFILE ||
+                           errno == ENOBUFS || errno == ENOMEM)) {
+            // the socket stays readable, so stop watching it for a while
+            perror("accept");
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+            loop->accept_paused = now_ms() + ACCEPT_BACKOFF_MS;
+            return;
+        }
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+
+        task_t *task = on_accept(connfd, (struct sockaddr *)&addr, addrlen);
+        if (task != NULL) {
+            push_task(loop, task);
+        }
+    }
+}
+
+/* Moves the tasks spawned on loop by other threads onto its run queue */
+static void take_incoming(loop_t *loop) {
+    uint64_t count;
+    if (read(loop->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    task_t *task = loop->incoming;
+    loop->incoming = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (task != NULL) {
+        task_t *next = task->next;
+        push_task(loop, task);
+        task = next;
+    }
+}
+
+/* Pins the calling thread to cpu */
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Body of an event loop thread */
+static void *loop_main(void *vargp) {
+    loop_t *loop = (loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (loop->cpu >= 0) {
+        pin_to_cpu(loop->cpu);
+    }
+
+    while (true) {
+        // don't sleep if there are tasks left to run, or some to steal.
+        // idle is set first, so a loop that queues up work after we looked
+        // will wake us up
+        int timeout = 0;
+        if (__atomic_load_n(&loop->len, __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&loop->idle, 1, __ATOMIC_SEQ_CST);
+            if (steal(loop) == 0) {
+                // timers, and a paused listener, only need to be looked at
+                // once per tick
+                timeout =
+                    __atomic_load_n(&loop->ntimers, __ATOMIC_RELAXED) > 0 ||
+                            loop->accept_paused != 0
+                        ? WHEEL_TICK_MS
+                        : -1;
+            }
+        }
+
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        __atomic_store_n(&loop->idle, 0, __ATOMIC_RELEASE);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listen_marker) {
+                accept_all(loop);
+            } else if (ptr == &wakeup_marker) {
+                take_incoming(loop);
+            } else {
+                push_task(loop, (task_t *)ptr);
+            }
+        }
+        run_timers(loop);
+        if (loop->accept_paused != 0 && now_ms() >= loop->accept_paused) {
+            loop->accept_paused = 0;
+            watch_listener(loop);
+        }
+
+        // resume every ready task. One that finishes has freed itself
+        task_t *task;
+        while ((task = pop_task(loop)) != NULL) {
+            task->loop = loop;
+            task->fn(task);
+        }
+    }
+    return NULL;
+}
+
+/* Starts nloops event loops, each in its own thread
+ *
+ * If listenfd is not negative, the loops accept connections on it
+ * themselves and call accept for each one
+ */
+void loop_init(int nloops, int listenfd, accept_fn *accept) {
+    if (nloops < 1) {
+        nloops = 1;
+    }
+    listen_fd = listenfd;
+    on_accept = accept;
+
+    if (listen_fd >= 0) {
+        int flags = fcntl(listen_fd, F_GETFL, 0);
+        fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    // one loop per core, as long as the proxy may run on enough of them.
+    // Those need not be numbered from 0, under taskset or in a container
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[ncpus++] = cpu;
+            }
+        }
+    }
+
+    loops = Calloc(nloops, sizeof(loop_t));
+    num_loops = nloops;
+    for (int i = 0; i < nloops; i++) {
+        loop_t *loop = &loops[i];
+        loop->cpu = nloops <= ncpus ? cpus[i] : -1;
+        pthread_mutex_init(&loop->lock, NULL);
+        pthread_mutex_init(&loop->timer_lock, NULL);
+        loop->cap = 64;
+        loop->tasks = Malloc(loop->cap * sizeof(task_t *));
+
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epfd < 0 || loop->efd < 0) {
+            perror("Failed to create event loop");
+            exit(1);
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeup_marker;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->efd, &ev);
+
+        if (listen_fd >= 0) {
+            watch_listener(loop);
+        }
+    }
+
+    for (int i = 0; i < nloops; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, loop_main, &loops[i]);
+        pthread_detach(tid);
+    }
+}
+
+/* Schedules a new task on one of the loops, in round robin order */
+void loop_spawn(task_t *task) {
+    unsigned idx = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED);
+    loop_t *loop = &loops[idx % num_loops];
+
+    pthread_mutex_lock(&loop->lock);
+    task->next = loop->incoming;
+    loop->incoming = task;
+    pthread_mutex_unlock(&loop->lock);
+
+    wake(loop);
+}
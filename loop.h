@@ -0,0 +1,129 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for loop.c
+ *
+ * These files implement the event loops that proxy.c runs its connections
+ * on. Each loop is a thread with its own epoll instance. A connection is
+ * a task: a coroutine (see coro.h) that is resumed by its loop whenever the
+ * descriptor it is waiting on becomes ready, so a handful of threads can
+ * serve any number of connections. Ready tasks wait on per-loop run queues,
+ * and a loop with nothing to do steals from the busiest one.
+ *
+ * Every loop also has a timer wheel, which tasks use to enforce deadlines.
+ * A timer does not resume its task, since the task may be waiting on another
+ * loop by then. Instead its function typically shuts down the descriptors
+ * of the task, which makes the operation the task is waiting on fail.
+ *
+ * Descriptors used by tasks must be in non-blocking mode.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "coro.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+typedef struct task task_t;
+typedef struct loop loop_t;
+typedef struct loop_timer loop_timer_t;
+
+/* Type of the body of a task. Returns CO_WAIT if it is waiting, or CO_DONE
+ * once it has finished, after which the loop does not touch it again
+ */
+typedef int task_fn(task_t *task);
+
+/* Type of the function called for every accepted connection. Returns the
+ * task to serve it, or NULL if it should not be served
+ */
+typedef task_t *accept_fn(int connfd, struct sockaddr *addr,
+                          socklen_t addrlen);
+
+/* Type for a task
+ *
+ * This is meant to be the first member of a bigger struct, which holds the
+ * state of the coroutine
+ *
+ * co is the coroutine resume point, which must be 0 initially
+ * fn is the body of the task
+ * loop is the loop the task is currently running on
+ * next is used to link the task into a run queue
+ */
+struct task {
+    int co;
+    task_fn *fn;
+    loop_t *loop;
+    task_t *next;
+};
+
+/* Type of the function called when a timer expires. Returns 0 if the timer
+ * is done, or the number of milliseconds after which it should expire again
+ *
+ * It runs on the thread of the loop the timer was started on, concurrently
+ * with the task, and must not start or stop timers itself
+ */
+typedef unsigned timer_fn(loop_timer_t *timer);
+
+/* Type for a timer, which is meant to be embedded in the state of a task
+ *
+ * expires is the monotonic time it expires at, in milliseconds
+ * fn is called when it expires
+ * loop is the loop whose wheel holds it, or NULL if it is not running
+ * next and pprev link it into a slot of the wheel
+ */
+struct loop_timer {
+    uint64_t expires;
+    timer_fn *fn;
+    loop_t *loop;
+    loop_timer_t *next;
+    loop_timer_t **pprev;
+};
+
+/* Suspends task until fd is ready for events
+ *
+ * Returns 0 on success, or -1 if fd could not be watched
+ */
+int task_wait(task_t *task, int fd, unsigned events);
+
+/* Stops watching fd on behalf of task, used before handing fd elsewhere */
+void task_forget(task_t *task, int fd);
+
+/* Starts timer, on behalf of the running task, so that fn is called in ms
+ * milliseconds. A timer that is already running is restarted
+ */
+void timer_start(task_t *task, loop_timer_t *timer, unsigned ms, timer_fn *fn);
+
+/* Stops timer, if it is running. Once this returns its function is not
+ * running and will not be called again, so the timer can be freed
+ */
+void timer_stop(loop_timer_t *timer);
+
+/* Evaluates expr, which must be a non-blocking operation that fails with
+ * errno EAGAIN when it would block, and stores its result in res. If it
+ * would block, the task waits until fd is ready for events and then
+ * evaluates expr again
+ */
+#define TASK_AWAIT_IO(task, res, fd, events, expr)                             \
+    do {                                                                       \
+        (task)->co = __LINE__;                                                 \
+    case __LINE__:                                                             \
+        if (((res) = (expr)) < 0 && errno == EAGAIN &&                         \
+            task_wait((task), (fd), (events)) == 0) {                          \
+            return CO_WAIT;                                                    \
+        }                                                                      \
+    } while (0)
+
+/* Starts nloops event loops, each in its own thread
+ *
+ * If listenfd is not negative, the loops accept connections on it
+ * themselves and call accept for each one
+ */
+void loop_init(int nloops, int listenfd, accept_fn *accept);
+
+/* Schedules a new task on one of the loops. Can be called from any thread */
+void loop_spawn(task_t *task);
+
+#endif /* LOOP_H */
@@ -0,0 +1,251 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the metrics of the proxy
+ *
+ * Shards are linked into a global list the first time their thread records
+ * something, and are never freed, so counts from threads that have exited
+ * still add up. Each value in a shard has a single writer, which updates it
+ * with relaxed atomic loads and stores so readers never see a torn value.
+ *
+ * See metrics.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "csapp.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// number of buckets in a histogram
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+// size of a cache line, which shards are aligned to
+#define CACHE_LINE 64
+
+/* Type for a latency histogram, in microseconds
+ *
+ * count is the number of values recorded, and sum is their total
+ * buckets holds the number of values that fell into each bucket
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/* Type for the metrics recorded by one thread */
+typedef struct shard {
+    uint64_t counters[METRIC_NUM_COUNTERS];
+    hist_t hists[METRIC_NUM_HISTS];
+    struct shard *next;
+} __attribute__((aligned(CACHE_LINE))) shard_t;
+
+/* Names and help texts for the Prometheus output */
+static const char *counter_names[METRIC_NUM_COUNTERS][2] = {
+    {"proxy_connections_total", "Connections accepted"},
+    {"proxy_requests_total", "Requests read from clients"},
+    {"proxy_relayed_bytes_total", "Response bytes relayed to clients"},
+    {"proxy_cache_hits_total", "Requests answered from the cache"},
+    {"proxy_cache_misses_total", "Requests not found in the cache"},
+    {"proxy_cache_evictions_total", "Objects evicted from the cache"},
+    {"proxy_cache_stale_total", "Stale objects served from the cache"},
+    {"proxy_rejected_total", "Connections turned away when overloaded"},
+    {"proxy_timeouts_total", "Connections cut off for missing a deadline"},
+};
+
+static const char *hist_names[METRIC_NUM_HISTS][2] = {
+    {"proxy_first_byte_seconds",
+     "Time from accept to the first response byte sent to the client"},
+    {"proxy_origin_connect_seconds", "Time taken to connect to the server"},
+    {"proxy_origin_ttfb_seconds",
+     "Time from sending the request to the first byte of the response"},
+    {"proxy_request_seconds", "Time from accept until the connection closed"},
+};
+
+// quantiles rendered for every histogram
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static shard_t *shards = NULL;
+static __thread shard_t *my_shard = NULL;
+
+/* Allocates a zeroed shard */
+static shard_t *new_shard(void) {
+    void *mem;
+    if (posix_memalign(&mem, CACHE_LINE, sizeof(shard_t)) != 0) {
+        perror("posix_memalign error");
+        exit(1);
+    }
+    return memset(mem, 0, sizeof(shard_t));
+}
+
+/* Returns the shard of the calling thread, creating it on first use */
+static shard_t *get_shard(void) {
+    if (my_shard != NULL) {
+        return my_shard;
+    }
+
+    shard_t *shard = new_shard();
+
+    pthread_mutex_lock(&shards_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+
+    my_shard = shard;
+    return shard;
+}
+
+/* Adds n to *p, which only the calling thread writes */
+static inline void bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/* Returns the index of the bucket that holds v microseconds */
+static size_t bucket_of(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+        return v;
+    }
+
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = exp - HIST_SUB_BITS;
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((v >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Returns the smallest value in microseconds above bucket idx */
+static uint64_t bucket_limit(size_t idx) {
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx + 1;
+    }
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = idx % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub + 1) << shift;
+}
+
+/* Returns the current monotonic time in nanoseconds */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds n to counter id */
+void metrics_count(counter_id id, uint64_t n) {
+    bump(&get_shard()->counters[id], n);
+}
+
+/* Records the time elapsed since start in histogram id */
+void metrics_since(hist_id id, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+
+    uint64_t now = metrics_now();
+    uint64_t us = now > start ? (now - start) / 1000 : 0;
+    hist_t *hist = &get_shard()->hists[id];
+    bump(&hist->count, 1);
+    bump(&hist->sum, us);
+    bump(&hist->buckets[bucket_of(us)], 1);
+}
+
+/* Adds up all shards into total, which must be zeroed */
+static void merge_shards(shard_t *total) {
+    pthread_mutex_lock(&shards_lock);
+    for (shard_t *shard = shards; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRIC_NUM_COUNTERS; i++) {
+            total->counters[i] +=
+                __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRIC_NUM_HISTS; i++) {
+            hist_t *from = &shard->hists[i];
+            hist_t *to = &total->hists[i];
+            to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+            for (size_t b = 0; b < HIST_BUCKETS; b++) {
+                to->buckets[b] +=
+                    __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+/* Returns the value in microseconds below which a fraction q of the values
+ * in hist fall, at the resolution of its buckets
+ */
+static uint64_t hist_quantile(const hist_t *hist, double q) {
+    uint64_t count = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        count += hist->buckets[b];
+        if (count > 0 && count >= q * hist->count) {
+            return bucket_limit(b);
+        }
+    }
+    return 0;
+}
+
+/* Renders hist as a Prometheus histogram called name, with a bucket for
+ * every power of two of microseconds, followed by its quantiles
+ */
+static void format_hist(FILE *out, const char *name, const char *help,
+                        const hist_t *hist) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    // a power of two 1 << exp is the limit of the bucket before it
+    uint64_t count = 0;
+    size_t b = 0;
+    for (int exp = HIST_SUB_BITS; exp <= HIST_MAX_EXP; exp++) {
+        for (; bucket_limit(b) <= (1ULL << exp); b++) {
+            count += hist->buckets[b];
+        }
+        fprintf(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name,
+                (double)(1ULL << exp) / 1e6, count);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, hist->count);
+    fprintf(out, "%s_sum %g\n", name, (double)hist->sum / 1e6);
+    fprintf(out, "%s_count %" PRIu64 "\n", name, hist->count);
+
+    fprintf(out, "# TYPE %s_quantile gauge\n", name);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[i],
+                (double)hist_quantile(hist, quantiles[i]) / 1e6);
+    }
+}
+
+/* Adds up all shards and renders them in the Prometheus text format */
+char *metrics_format(size_t *len) {
+    shard_t *total = new_shard();
+    merge_shards(total);
+
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+    if (out == NULL) {
+        perror("open_memstream error");
+        exit(1);
+    }
+
+    for (int i = 0; i < METRIC_NUM_COUNTERS; i++) {
+        const char *name = counter_names[i][0];
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+                name, counter_names[i][1], name, name, total->counters[i]);
+    }
+    for (int i = 0; i < METRIC_NUM_HISTS; i++) {
+        format_hist(out, hist_names[i][0], hist_names[i][1],
+                    &total->hists[i]);
+    }
+
+    fclose(out);
+    free(total);
+    return text;
+}
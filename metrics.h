@@ -0,0 +1,77 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for metrics.c
+ *
+ * These files implement the counters and latency histograms of the proxy.
+ * Every thread that records something gets a shard of its own, aligned to a
+ * cache line, which only it ever writes. Recording is therefore a couple of
+ * plain loads and stores, with no locks, atomic read-modify-writes, or cache
+ * lines bouncing between cores. Readers add all shards up on demand.
+ *
+ * Latencies go into log-linear histograms in the spirit of HdrHistogram:
+ * each power of two of microseconds is split into HIST_SUB_BUCKETS buckets,
+ * so any recorded value is known to within about 6%, from a microsecond up
+ * to hours.
+ *
+ * metrics_format renders everything in the Prometheus text format, which
+ * proxy.c serves at METRICS_PATH.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// URI at which the proxy serves its metrics
+#define METRICS_PATH "/__proxy/metrics"
+
+// buckets per power of two in a histogram, and the largest power of two
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 35
+
+/* Counters */
+typedef enum {
+    METRIC_CONNECTIONS,     // connections accepted
+    METRIC_REQUESTS,        // requests read from clients
+    METRIC_BYTES,           // response bytes relayed to clients
+    METRIC_CACHE_HITS,      // requests answered from the cache
+    METRIC_CACHE_MISSES,    // requests not found in the cache
+    METRIC_CACHE_EVICTIONS, // objects evicted from the cache
+    METRIC_CACHE_STALE,     // stale objects served
+    METRIC_REJECTED,        // connections turned away by admission control
+    METRIC_TIMEOUTS,        // connections cut off for missing a deadline
+    METRIC_NUM_COUNTERS
+} counter_id;
+
+/* Latency histograms */
+typedef enum {
+    METRIC_FIRST_BYTE, // accept to first response byte sent to the client
+    METRIC_CONNECT,    // connecting and sending the request
+    METRIC_TTFB,       // request sent to first response byte from the server
+    METRIC_TOTAL,      // accept to the connection being done
+    METRIC_NUM_HISTS
+} hist_id;
+
+/* Returns the current monotonic time in nanoseconds, for use with
+ * metrics_since
+ */
+uint64_t metrics_now(void);
+
+/* Adds n to counter id */
+void metrics_count(counter_id id, uint64_t n);
+
+/* Records the time elapsed since start, a time from metrics_now, in
+ * histogram id. Does nothing if start is 0
+ */
+void metrics_since(hist_id id, uint64_t start);
+
+/* Adds up all shards and renders them in the Prometheus text format
+ *
+ * Returns the text, which must be freed by the caller, and stores its length
+ * in *len
+ */
+char *metrics_format(size_t *len);
+
+#endif /* METRICS_H */
@@ -0,0 +1,135 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements non-blocking buffered I/O
+ *
+ * It is intended for use with proxy.c. See nbio.h for more
+ */
+
+#include "nbio.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Associates fd with the reader rp, and empties its buffer */
+void nbio_readinitb(nbio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->cnt = 0;
+    rp->bufptr = NULL;
+    rp->eof = false;
+    rp->buf = NULL;
+}
+
+/* Frees the buffer of rp, if it has one */
+void nbio_free(nbio_t *rp) {
+    free(rp->buf);
+    rp->buf = NULL;
+    rp->bufptr = NULL;
+    rp->cnt = 0;
+}
+
+/* Reads more data into the buffer of rp, after any unread bytes
+ *
+ * Returns the number of bytes read, 0 on end of file or -1 on error
+ */
+static ssize_t fill(nbio_t *rp) {
+    if (rp->buf == NULL) {
+        rp->buf = Malloc(NBIO_BUFSIZE);
+        rp->bufptr = rp->buf;
+    }
+
+    // move the unread bytes to the front to make room
+    if (rp->bufptr != rp->buf) {
+        memmove(rp->buf, rp->bufptr, rp->cnt);
+        rp->bufptr = rp->buf;
+    }
+
+    while (true) {
+        ssize_t nread =
+            read(rp->fd, rp->buf + rp->cnt, NBIO_BUFSIZE - rp->cnt);
+        if (nread < 0) {
+            if (errno != EINTR) {
+                return -1; // errno set by read(), EAGAIN if no data yet
+            }
+        } else {
+            if (nread == 0) {
+                rp->eof = true;
+            }
+            rp->cnt += nread;
+            return nread;
+        }
+    }
+}
+
+/* Points *linep at the next text line in the buffer of rp */
+ssize_t nbio_peekline(nbio_t *rp, char **linep) {
+    while (true) {
+        char *nl = rp->cnt > 0 ? memchr(rp->bufptr, '\n', rp->cnt) : NULL;
+        if (nl != NULL) {
+            *linep = rp->bufptr;
+            return nl - rp->bufptr + 1;
+        }
+
+        // no newline, and either the buffer is full or no more data comes
+        if (rp->cnt == NBIO_BUFSIZE || rp->eof) {
+            *linep = rp->bufptr;
+            return (ssize_t)rp->cnt;
+        }
+
+        if (fill(rp) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Consumes the first n unread bytes of rp */
+void nbio_consume(nbio_t *rp, size_t n) {
+    rp->bufptr += n;
+    rp->cnt -= n;
+}
+
+/* Reads at most n bytes into usrbuf, bypassing the buffer when it is empty */
+ssize_t nbio_readb(nbio_t *rp, void *usrbuf, size_t n) {
+    if (rp->cnt > 0) {
+        size_t cnt = rp->cnt < n ? rp->cnt : n;
+        memcpy(usrbuf, rp->bufptr, cnt);
+        nbio_consume(rp, cnt);
+        return (ssize_t)cnt;
+    }
+    if (rp->eof) {
+        return 0;
+    }
+
+    while (true) {
+        ssize_t nread = read(rp->fd, usrbuf, n);
+        if (nread < 0) {
+            if (errno != EINTR) {
+                return -1; // errno set by read(), EAGAIN if no data yet
+            }
+        } else {
+            if (nread == 0) {
+                rp->eof = true;
+            }
+            return nread;
+        }
+    }
+}
+
+/* Writes the n bytes of usrbuf to fd, starting at offset *off */
+ssize_t nbio_writen(int fd, const void *usrbuf, size_t n, size_t *off) {
+    const char *bufp = usrbuf;
+
+    while (*off < n) {
+        ssize_t nwritten = write(fd, bufp + *off, n - *off);
+        if (nwritten < 0) {
+            if (errno != EINTR) {
+                return -1; // errno set by write(), EAGAIN if full
+            }
+        } else {
+            *off += nwritten;
+        }
+    }
+    return (ssize_t)n;
+}
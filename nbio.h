@@ -0,0 +1,79 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for nbio.c
+ *
+ * These files implement a non-blocking counterpart of the rio package in
+ * csapp.c, for use with descriptors in non-blocking mode. Instead of waiting
+ * for data, every function fails with errno EAGAIN when it cannot finish
+ * yet, keeping its progress so it can simply be called again once the
+ * descriptor is ready (see TASK_AWAIT_IO in loop.h).
+ *
+ * Unlike rio, a reader does not have to copy what it reads. nbio_peekline
+ * hands out a view of a line inside the reader's own buffer, which stays
+ * valid until the next call on that reader, and nbio_consume drops it once
+ * it has been dealt with. nbio_readb only goes through the buffer for bytes
+ * that are already in it, and otherwise reads straight into the caller's
+ * buffer. The buffer itself is only allocated once something needs it.
+ */
+
+#ifndef NBIO_H
+#define NBIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define NBIO_BUFSIZE 8192
+
+/* Type for a buffered non-blocking reader
+ *
+ * fd is the descriptor being read
+ * cnt is the number of unread bytes in buf
+ * bufptr is the next unread byte in buf
+ * eof is set once read has returned end of file
+ * buf holds NBIO_BUFSIZE bytes, or is NULL until it is first needed
+ */
+typedef struct {
+    int fd;
+    size_t cnt;
+    char *bufptr;
+    bool eof;
+    char *buf;
+} nbio_t;
+
+/* Associates fd with the reader rp, and empties its buffer */
+void nbio_readinitb(nbio_t *rp, int fd);
+
+/* Frees the buffer of rp, if it has one */
+void nbio_free(nbio_t *rp);
+
+/* Points *linep at the next text line in the buffer of rp, including its
+ * newline, without consuming it
+ *
+ * Returns the length of the line, 0 on end of file, or -1 on error. Fails
+ * with EAGAIN while no complete line has arrived. A line that doesn't fit
+ * the buffer, or the last line before end of file, is returned without its
+ * newline
+ */
+ssize_t nbio_peekline(nbio_t *rp, char **linep);
+
+/* Consumes the first n unread bytes of rp, which must have been peeked */
+void nbio_consume(nbio_t *rp, size_t n);
+
+/* Reads at most n bytes into usrbuf. Buffered bytes are returned first, and
+ * once there are none left the read goes straight into usrbuf
+ *
+ * Returns the number of bytes read, 0 on end of file, or -1 on error. Fails
+ * with EAGAIN if there is nothing to read yet
+ */
+ssize_t nbio_readb(nbio_t *rp, void *usrbuf, size_t n);
+
+/* Writes the n bytes of usrbuf to fd, starting at offset *off, which is
+ * advanced past every byte written
+ *
+ * Returns n once everything has been written, or -1 on error. Fails with
+ * EAGAIN if the descriptor is full before everything was written
+ */
+ssize_t nbio_writen(int fd, const void *usrbuf, size_t n, size_t *off);
+
+#endif /* NBIO_H */
@@ -0,0 +1,63 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the option tables used by the modules of proxy.c
+ *
+ * See options.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// narrowest the column of option names gets in options_usage
+#define NAME_WIDTH 18
+
+/* Sets the option described by spec, of the form "name=value" */
+int options_parse(const option_t *options, size_t nopts, const char *spec,
+                  long max) {
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL) {
+        return -1;
+    }
+
+    char *end;
+    long value = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || *end != '\0' || value < 0 || value > max) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < nopts; i++) {
+        const option_t *opt = &options[i];
+        if (strlen(opt->name) != (size_t)(eq - spec) ||
+            strncmp(opt->name, spec, eq - spec) != 0) {
+            continue;
+        }
+        if (opt->flag) {
+            *(bool *)opt->value = value != 0;
+        } else {
+            *(int *)opt->value = (int)value;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Prints the names and meaning of all options to stdout */
+void options_usage(const option_t *options, size_t nopts) {
+    int width = NAME_WIDTH;
+    for (size_t i = 0; i < nopts; i++) {
+        int len = (int)strlen(options[i].name);
+        width = len > width ? len : width;
+    }
+
+    for (size_t i = 0; i < nopts; i++) {
+        const option_t *opt = &options[i];
+        int value = opt->flag ? *(bool *)opt->value : *(int *)opt->value;
+        printf("    %-*s %s (default: %d)\n", width, opt->name, opt->help,
+               value);
+    }
+}
@@ -0,0 +1,49 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for options.c
+ *
+ * These files implement the "name=value" options that tune the modules of
+ * the proxy, such as the -s, -a, -t and -c flags. Each module describes its
+ * options in a table of option_t, and hands that table to options_parse and
+ * options_usage. Every value is a non-negative integer, and flags are simply
+ * options that are either on (1) or off (0).
+ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// number of entries in a table of options
+#define NUM_OPTIONS(table) (sizeof(table) / sizeof((table)[0]))
+
+/* Type for an entry in a table of options
+ *
+ * name is what the option is called on the command line
+ * flag is set for options that are either on (1) or off (0)
+ * value points at the option, as an int or, for a flag, a bool
+ * help describes the option
+ */
+typedef struct {
+    const char *name;
+    bool flag;
+    void *value;
+    const char *help;
+} option_t;
+
+/* Sets the option of the nopts in options described by spec, of the form
+ * "name=value". Values above max are refused
+ *
+ * Returns 0 on success, or -1 if spec does not name a known option or its
+ * value is not valid
+ */
+int options_parse(const option_t *options, size_t nopts, const char *spec,
+                  long max);
+
+/* Prints the names, meaning and current values of the nopts options in
+ * options to stdout
+ */
+void options_usage(const option_t *options, size_t nopts);
+
+#endif /* OPTIONS_H */
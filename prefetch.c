@@ -0,0 +1,189 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the link finding used by proxy.c to prefetch
+ *
+ * This is a scan for tags, not an HTML parser: comments and scripts are not
+ * skipped, and entities in URLs are not decoded. A link that is missed or
+ * made up only costs a wasted or missing prefetch, never a wrong response,
+ * since the browser still asks for what it actually needs.
+ *
+ * See prefetch.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+#include "csapp.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/* Returns true if the headers of the response at buf, whose last line ends
+ * right before end, say that it is an HTML page
+ */
+static bool is_html(const char *buf, const char *end) {
+    const char *line = buf;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            break;
+        }
+        if (eol - line > 13 && strncasecmp(line, "Content-Type:", 13) == 0) {
+            const char *value = line + 13;
+            while (value < eol && isspace((unsigned char)*value)) {
+                value++;
+            }
+            return eol - value >= 9 && strncasecmp(value, "text/html", 9) == 0;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+/* Finds the value of the attribute attr in the tag between p and end
+ *
+ * Returns a pointer to the value and stores its length in *len, or returns
+ * NULL if the tag does not have it
+ */
+static const char *find_attr(const char *p, const char *end, const char *attr,
+                             size_t *len) {
+    size_t attr_len = strlen(attr);
+    for (; p + attr_len < end; p++) {
+        // the attribute name must start a word, and be followed by =
+        if (!isspace((unsigned char)p[-1]) ||
+            strncasecmp(p, attr, attr_len) != 0) {
+            continue;
+        }
+        const char *v = p + attr_len;
+        while (v < end && isspace((unsigned char)*v)) {
+            v++;
+        }
+        if (v == end || *v != '=') {
+            continue;
+        }
+        v++;
+        while (v < end && isspace((unsigned char)*v)) {
+            v++;
+        }
+
+        // the value is either quoted or runs until whitespace
+        const char *stop;
+        if (v < end && (*v == '"' || *v == '\'')) {
+            char quote = *v++;
+            stop = memchr(v, quote, end - v);
+        } else {
+            stop = v;
+            while (stop < end && !isspace((unsigned char)*stop)) {
+                stop++;
+            }
+        }
+        if (stop == NULL || stop == v) {
+            return NULL;
+        }
+        *len = stop - v;
+        return v;
+    }
+    return NULL;
+}
+
+/* Makes the link of len bytes at link absolute relative to the page at uri,
+ * whose origin ("http://host:port") is the first origin_len bytes of uri,
+ * and writes it to url, which holds MAXLINE bytes
+ *
+ * Returns true on success, or false if the link is on another origin or
+ * uses another scheme
+ */
+static bool resolve(const char *uri, size_t origin_len, const char *link,
+                    size_t len, char *url) {
+    // drop the fragment, which is never sent to the server
+    const char *hash = memchr(link, '#', len);
+    if (hash != NULL) {
+        len = hash - link;
+    }
+    if (len == 0) {
+        return false;
+    }
+
+    int n;
+    if (len > 7 && strncasecmp(link, "http://", 7) == 0) {
+        n = snprintf(url, MAXLINE, "%.*s", (int)len, link);
+    } else if (len > 2 && link[0] == '/' && link[1] == '/') {
+        n = snprintf(url, MAXLINE, "http:%.*s", (int)len, link);
+    } else if (link[0] == '/') {
+        n = snprintf(url, MAXLINE, "%.*s%.*s", (int)origin_len, uri, (int)len,
+                     link);
+    } else {
+        // any other scheme, such as https: or data:, comes before a slash
+        const char *colon = memchr(link, ':', len);
+        const char *slash = memchr(link, '/', len);
+        if (colon != NULL && (slash == NULL || colon < slash)) {
+            return false;
+        }
+
+        // relative to the directory of the page
+        const char *dir_end = strrchr(uri + origin_len, '/');
+        size_t dir_len = dir_end != NULL ? (size_t)(dir_end - uri) + 1
+                                         : origin_len;
+        n = snprintf(url, MAXLINE, "%.*s%s%.*s", (int)dir_len, uri,
+                     dir_end != NULL ? "" : "/", (int)len, link);
+    }
+    if (n < 0 || n >= MAXLINE) {
+        return false;
+    }
+
+    // same origin only, including the exact same host and port
+    return strncasecmp(url, uri, origin_len) == 0 &&
+           (url[origin_len] == '/' || url[origin_len] == '\0');
+}
+
+/* Finds the links in the HTTP response held in the n bytes at buf */
+size_t prefetch_links(const char *uri, const char *buf, size_t n,
+                      prefetch_fn *fetch) {
+    const char *headers_end = memmem(buf, n, "\r\n\r\n", 4);
+    if (headers_end == NULL || !is_html(buf, headers_end + 2) ||
+        strncasecmp(uri, "http://", 7) != 0) {
+        return 0;
+    }
+
+    // the origin is everything up to the path
+    const char *path = strchr(uri + 7, '/');
+    size_t origin_len = path != NULL ? (size_t)(path - uri) : strlen(uri);
+
+    static const struct {
+        const char *tag;
+        const char *attr;
+    } tags[] = {{"<img", "src"}, {"<script", "src"}, {"<link", "href"}};
+
+    size_t found = 0;
+    const char *end = buf + n;
+    const char *p = headers_end + 4;
+    while (found < PREFETCH_MAX_LINKS &&
+           (p = memchr(p, '<', end - p)) != NULL) {
+        const char *close = memchr(p, '>', end - p);
+        if (close == NULL) {
+            break;
+        }
+
+        for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+            size_t tag_len = strlen(tags[i].tag);
+            size_t len;
+            const char *link;
+            char url[MAXLINE];
+            if (close - p > (ptrdiff_t)tag_len &&
+                strncasecmp(p, tags[i].tag, tag_len) == 0 &&
+                isspace((unsigned char)p[tag_len]) &&
+                (link = find_attr(p + tag_len, close, tags[i].attr, &len)) !=
+                    NULL &&
+                resolve(uri, origin_len, link, len, url)) {
+                fetch(url);
+                found += 1;
+                break;
+            }
+        }
+        p = close + 1;
+    }
+    return found;
+}
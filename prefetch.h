@@ -0,0 +1,33 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for prefetch.c
+ *
+ * These files find the sub-resources of HTML pages for proxy.c, so it can
+ * fetch them into the cache before the browser that got the page asks for
+ * them. The sources of <img> and <script> tags and the targets of <link>
+ * tags are taken, as long as they are on the same origin as the page, made
+ * absolute relative to the page's URI, and handed to a function of the
+ * proxy one by one.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+
+// most links taken from a single page
+#define PREFETCH_MAX_LINKS 16
+
+/* Type of the function called with the absolute URL of every link found */
+typedef void prefetch_fn(const char *url);
+
+/* Finds the links in the HTTP response held in the n bytes at buf, which was
+ * fetched from uri, and calls fetch for each of them. Does nothing unless the
+ * response is an HTML page
+ *
+ * Returns the number of links found
+ */
+size_t prefetch_links(const char *uri, const char *buf, size_t n,
+                      prefetch_fn *fetch);
+
+#endif /* PREFETCH_H */
@@ -0,0 +1,247 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the profiling mode of the proxy
+ *
+ * Samples go into a preallocated array, claimed with an atomic counter, so
+ * the signal handler neither locks nor allocates. backtrace is called once
+ * up front, since its first call loads the unwinder. Once the array is full
+ * further samples are only counted. Nothing is symbolized or aggregated
+ * until the profile is written, by a thread of its own that waits for
+ * SIGINT or SIGTERM with sigwait.
+ *
+ * Function names come from backtrace_symbols, so the proxy is linked with
+ * -rdynamic. Functions it cannot name, such as static ones, show up as the
+ * module they belong to.
+ *
+ * See profile.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "profile.h"
+#include "csapp.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// frames of the signal handler and trampoline at the top of every sample
+#define SKIP_FRAMES 2
+
+/* Type for a sampled stack, innermost frame first */
+typedef struct {
+    bool done;
+    int depth;
+    void *pcs[PROFILE_MAX_DEPTH];
+} sample_t;
+
+/* Type for the time spent in a stage, in nanoseconds */
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+} stage_t;
+
+bool profile_enabled = false;
+
+static FILE *out = NULL;
+static sample_t *samples = NULL;
+static size_t nsamples = 0;
+static stage_t stages[TRACE_NUM_POINTS];
+
+static const char *stage_names[TRACE_NUM_POINTS] = {
+    "parsed", "connected", "first_byte", "done",
+};
+
+/* Records the stack of the interrupted thread */
+static void on_sigprof(int sig) {
+    (void)sig;
+    int saved = errno;
+    size_t i = __atomic_fetch_add(&nsamples, 1, __ATOMIC_RELAXED);
+    if (i < PROFILE_MAX_SAMPLES) {
+        sample_t *s = &samples[i];
+        s->depth = backtrace(s->pcs, PROFILE_MAX_DEPTH);
+        __atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+    }
+    errno = saved;
+}
+
+/* Adds the time since *last to stage point, see profile.h */
+void profile_trace(trace_point point, uint64_t *last) {
+    uint64_t now = metrics_now();
+    if (*last != 0) {
+        stage_t *stage = &stages[point];
+        uint64_t took = now - *last;
+        __atomic_add_fetch(&stage->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stage->total, took, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&stage->max, __ATOMIC_RELAXED);
+        while (took > max &&
+               !__atomic_compare_exchange_n(&stage->max, &max, took, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    *last = now;
+}
+
+/* Appends the name of the function of a symbol from backtrace_symbols,
+ * "module(function+offset) [address]", to buf, which has room for len
+ * bytes. Unnamed functions are written as "[module]"
+ *
+ * Returns the number of bytes appended
+ */
+static size_t append_frame(char *buf, size_t len, const char *sym) {
+    const char *open = strchr(sym, '(');
+    const char *plus = open != NULL ? strpbrk(open, "+)") : NULL;
+    int n;
+    if (plus != NULL && plus > open + 1) {
+        n = snprintf(buf, len, "%.*s", (int)(plus - open - 1), open + 1);
+    } else {
+        size_t mod_len = open != NULL ? (size_t)(open - sym) : strlen(sym);
+        const char *slash = memrchr(sym, '/', mod_len);
+        const char *mod = slash != NULL ? slash + 1 : sym;
+        n = snprintf(buf, len, "[%.*s]", (int)(sym + mod_len - mod), mod);
+    }
+    return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/* Returns the folded form of sample s, outermost frame first, or NULL if
+ * it has no frames of its own
+ */
+static char *fold(sample_t *s) {
+    int depth = s->depth - SKIP_FRAMES;
+    if (depth <= 0) {
+        return NULL;
+    }
+    char **syms = backtrace_symbols(s->pcs + SKIP_FRAMES, depth);
+    if (syms == NULL) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < depth; i++) {
+        len += strlen(syms[i]) + 3;
+    }
+    char *folded = Malloc(len + 1);
+    size_t pos = 0;
+    for (int i = depth - 1; i >= 0; i--) {
+        pos += append_frame(folded + pos, len + 1 - pos, syms[i]);
+        if (i > 0) {
+            folded[pos++] = ';';
+        }
+    }
+    folded[pos] = '\0';
+    free(syms);
+    return folded;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Writes the samples taken so far as folded stacks, and the time spent in
+ * every stage to stderr
+ */
+static void profile_write(void) {
+    size_t taken = __atomic_load_n(&nsamples, __ATOMIC_RELAXED);
+    size_t kept = taken < PROFILE_MAX_SAMPLES ? taken : PROFILE_MAX_SAMPLES;
+
+    // identical stacks end up next to each other once sorted
+    char **stacks = Malloc((kept > 0 ? kept : 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < kept; i++) {
+        sample_t *s = &samples[i];
+        if (__atomic_load_n(&s->done, __ATOMIC_ACQUIRE) &&
+            (stacks[n] = fold(s)) != NULL) {
+            n++;
+        }
+    }
+    qsort(stacks, n, sizeof(char *), compare_strings);
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && strcmp(stacks[i], stacks[j]) == 0) {
+            j++;
+        }
+        fprintf(out, "%s %zu\n", stacks[i], j - i);
+        for (; i < j; i++) {
+            free(stacks[i]);
+        }
+    }
+    free(stacks);
+    fclose(out);
+
+    fprintf(stderr, "Profile: %zu samples", taken);
+    if (taken > kept) {
+        fprintf(stderr, ", %zu dropped", taken - kept);
+    }
+    fprintf(stderr, "\n%-12s %10s %12s %12s\n", "stage", "count",
+            "mean_us", "max_us");
+    for (int i = 0; i < TRACE_NUM_POINTS; i++) {
+        stage_t *stage = &stages[i];
+        uint64_t count = __atomic_load_n(&stage->count, __ATOMIC_RELAXED);
+        uint64_t total = __atomic_load_n(&stage->total, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&stage->max, __ATOMIC_RELAXED);
+        fprintf(stderr, "%-12s %10" PRIu64 " %12.1f %12.1f\n", stage_names[i],
+                count, count > 0 ? total / 1000.0 / count : 0.0,
+                max / 1000.0);
+    }
+}
+
+/* Thread routine waiting for the proxy to be stopped, then writing the
+ * profile and exiting
+ */
+static void *profile_waiter(void *vargp) {
+    sigset_t *stop = vargp;
+    int sig;
+    sigwait(stop, &sig);
+
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    profile_write();
+    exit(0);
+}
+
+/* Starts profiling, see profile.h */
+int profile_start(const char *path) {
+    out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    samples = Calloc(PROFILE_MAX_SAMPLES, sizeof(sample_t));
+
+    // load the unwinder now rather than in the signal handler
+    void *pcs[1];
+    backtrace(pcs, 1);
+
+    // only the waiter gets to see SIGINT and SIGTERM
+    static sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, profile_waiter, &stop) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval every = {{0, 1000000 / PROFILE_HZ},
+                              {0, 1000000 / PROFILE_HZ}};
+    setitimer(ITIMER_PROF, &every, NULL);
+    profile_enabled = true;
+    return 0;
+}
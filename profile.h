@@ -0,0 +1,82 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for profile.c
+ *
+ * These files implement the profiling mode of the proxy. While it is on, a
+ * SIGPROF timer interrupts whichever thread is using the CPU PROFILE_HZ
+ * times per second of CPU time, and the signal handler records the stack
+ * of that thread with backtrace(3). When the proxy is stopped by SIGINT or
+ * SIGTERM, the stacks are written out in the folded format of FlameGraph's
+ * stackcollapse scripts, one "caller;callee;... count" line per distinct
+ * stack, ready for flamegraph.pl.
+ *
+ * serve also marks the stages of every request with PROFILE_TRACE. Where
+ * <sys/sdt.h> is available these are USDT probes "proxy:PARSED" and so on,
+ * which cost a nop until a tracer attaches to them. In profiling mode the
+ * time spent in every stage is also added up, and reported on stderr next
+ * to the stacks. Accepting a connection only starts the first stage, so it
+ * is marked with a bare "proxy:ACCEPT" probe, see PROFILE_PROBE.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROFILE_PROBE(point) DTRACE_PROBE(proxy, point)
+#endif
+#endif
+#ifndef PROFILE_PROBE
+#define PROFILE_PROBE(point)
+#endif
+
+// samples per second of CPU time
+#define PROFILE_HZ 499
+
+// most samples kept, and most frames kept of each
+#define PROFILE_MAX_SAMPLES (1 << 17)
+#define PROFILE_MAX_DEPTH 48
+
+/* Stages of a request, each traced when it ends. The first one starts when
+ * the connection is accepted
+ */
+typedef enum {
+    TRACE_PARSED,     // request read and parsed
+    TRACE_CONNECTED,  // connected, and request sent to the server
+    TRACE_FIRST_BYTE, // first response byte sent to the client
+    TRACE_DONE,       // connection done
+    TRACE_NUM_POINTS
+} trace_point;
+
+/* Marks the end of stage point of a request. last holds the time its
+ * previous stage ended, and is updated
+ */
+#define PROFILE_TRACE(point, last)                                            \
+    do {                                                                      \
+        PROFILE_PROBE(point);                                                 \
+        if (profile_enabled) {                                                \
+            profile_trace(TRACE_##point, last);                               \
+        }                                                                     \
+    } while (0)
+
+// whether profiling is on
+extern bool profile_enabled;
+
+/* Starts profiling, to be written to the file at path when the proxy is
+ * stopped. Must be called before any other thread is created, since it
+ * blocks SIGINT and SIGTERM for all of them
+ *
+ * Returns 0 on success, or -1 if the file cannot be created
+ */
+int profile_start(const char *path);
+
+/* Adds the time since *last to stage point, and sets *last to now. Does
+ * not add anything if *last is 0
+ */
+void profile_trace(trace_point point, uint64_t *last);
+
+#endif /* PROFILE_H */
@@ -7,12 +7,27 @@
  */
 
 #include "csapp.h"
+#include "accesslog.h"
+#include "admit.h"
 #include "cache.h"
+#include "connector.h"
+#include "loop.h"
+#include "metrics.h"
+#include "nbio.h"
+#include "prefetch.h"
+#include "profile.h"
+#include "resolver.h"
+#include "sockopt.h"
+#include "timeout.h"
+#include "uring.h"
+#include "warmup.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,10 +35,14 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -39,20 +58,77 @@
 #define dbg_printf(...)
 #endif
 
-#define HOSTLEN 256
-#define SERVLEN 8
 #define READLEN 4096
+#define MAX_READLEN (256 * 1024)
+
+#define NSEC_PER_SEC 1000000000ull
+
+// most links of pages being prefetched at once
+#define PREFETCH_MAX_INFLIGHT 8
+
+// time serve gets to answer 504 to a cancelled lookup, in milliseconds
+#define LOOKUP_GRACE_MS 1000
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
-/* Information about a connected client. This is adapted from TINY server */
+/* State of a request while it is read, parsed and forwarded. It is only
+ * allocated until the request has been sent upstream, so connections that
+ * are relaying a response stay small
+ */
 typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
+    char method[MAXLINE];        // Request method
+    char uri[MAXLINE];           // Request URI
+    char version;                // Minor HTTP version
+    char host_header[MAXBUF];    // Host header sent by the client
+    char other_headers[MAXBUF];  // Other headers to forward
+    size_t prev_write;           // Length of other_headers
+    char hostname[MAXLINE];      // Server host
+    char port[MAXLINE];          // Server port
+    char dir[MAXLINE];           // Requested path on the server
+    connector_t *conn;           // Connector racing the addresses
+    char get_req[MAXBUF];        // Request sent to the server
+    size_t req_length;           // Length of get_req
+} request_t;
+
+/* Information about a connected client. This is adapted from TINY server
+ *
+ * The connection is served by a coroutine (see loop.h), so everything that
+ * must survive a wait lives in here
+ */
+typedef struct {
+    task_t task;                  // Coroutine state, must come first
+    struct sockaddr_storage addr; // Socket address
+    socklen_t addrlen;            // Socket address length
+    int connfd;                   // Client connection file descriptor
+    int serverfd;                 // Server connection file descriptor
+    nbio_t rio;                   // Buffered reader for the client
+    nbio_t srio;                  // Buffered reader for the server
+    request_t *req;               // Request being handled, if any
+    char *out;                    // Error response to send to the client
+    size_t outlen;                // Length of out
+    size_t outoff;                // Bytes of the current write already sent
+    char *res_buf;                // Relay buffer for the response
+    size_t res_len;               // Bytes in res_buf
+    size_t readlen;               // Size of res_buf, and of the next read
+    size_t res_total;             // Bytes relayed to the client so far
+    uint64_t accepted;            // Time the connection was accepted
+    uint64_t stage_start;         // Time the connect or request was started
+    uint64_t traced;              // Time the last traced stage ended
+    log_record_t log;             // Access log record of the request
+    admit_ticket_t ticket;        // Admission of the connection
+    loop_timer_t timer;           // Timer enforcing the deadlines
+    uint64_t deadline;            // Time by which the current stage must end
+    lookup_t *lookup;             // Lookup of the server addresses
+    uint64_t last_active;         // Time of the last read or write
+    obj_t *hit;                   // Cached response to serve, or fall back on
+    obj_t *refresh;               // Stale object this task is refreshing
+    bool warmup;                  // Whether this task is warming the cache up
+    bool prefetch;                // Whether this task is prefetching a link
+    char *key;                    // Cache key, while the response may be cached
+    char *cache_buf;              // Response kept for the cache
+    size_t cache_len;             // Bytes in cache_buf
+    size_t cache_cap;             // Size of cache_buf
 } client_info;
 
 /* URI parsing results. Adapted from TINY server */
@@ -65,11 +141,20 @@ static const char *header_user_agent = "Mozilla/5.0"
                                        " (X11; Linux x86_64; rv:3.10.0)"
                                        " Gecko/20191101 Firefox/63.0.1";
 
+/* Whether responses are relayed by the io_uring backend (see uring.h) */
+static bool use_uring = false;
+
+/* Whether the links of cached pages are prefetched, and how many are being */
+static bool prefetch_pages = false;
+static int prefetching = 0;
+
 /* This code is adapted from TINY server (tiny.c)
- * clienterror - returns an error message to the client
+ * clienterror - builds an error message for the client
+ *
+ * The message is kept in client->out, and sent by serve before it hangs up
  */
-void clienterror(int fd, const char *errnum, const char *shortmsg,
-                 const char *longmsg) {
+void clienterror(client_info *client, const char *errnum,
+                 const char *shortmsg, const char *longmsg) {
     char buf[MAXLINE];
     char body[MAXBUF];
     size_t buflen;
@@ -100,97 +185,116 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
         return; // Overflow!
     }
 
-    /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing error response headers to client\n");
-        return;
+    /* Keep headers and body together, to be written by serve */
+    client->log.status = atoi(errnum);
+    free(client->out);
+    client->out = Malloc(buflen + bodylen);
+    memcpy(client->out, buf, buflen);
+    memcpy(client->out + buflen, body, bodylen);
+    client->outlen = buflen + bodylen;
+}
+
+/* Returns true if the len bytes at name are exactly the string want */
+bool name_is(const char *name, size_t len, const char *want) {
+    return strlen(want) == len && memcmp(name, want, len) == 0;
+}
+
+/* Copies the next whitespace separated word of the line between *pos and
+ * end into word, which holds MAXLINE bytes, and moves *pos past it
+ *
+ * Returns the length of the word, or 0 if there is none or it is too long
+ */
+size_t next_word(const char **pos, const char *end, char *word) {
+    const char *p = *pos;
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
     }
+    const char *start = p;
+    while (p < end && !isspace((unsigned char)*p)) {
+        p++;
+    }
+    *pos = p;
 
-    /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
-        fprintf(stderr, "Error writing error response body to client\n");
-        return;
+    size_t len = p - start;
+    if (len >= MAXLINE) {
+        return 0;
     }
+    memcpy(word, start, len);
+    word[len] = '\0';
+    return len;
 }
 
-
-/* The following code has parts adapted from TINY server (tiny.c)
- *
- * read_responsehdrs - read HTTP response headers.
+/* read_requestline - parse the request line held in the n bytes at line,
+ * a view into the client's reader, into req->method, req->uri and
+ * req->version. It must have the form "METHOD URI HTTP/1.x"
  *
- * Returns true if an error occurred, or false otherwise.
+ * Returns true if the request line is malformed, or false otherwise.
  */
-bool read_responsehdrs(client_info *client, rio_t *rp) {
-    char buf[MAXLINE];
-    char name[MAXLINE];
-    char value[MAXLINE];
-
-    while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
-            return true;
-        }
+bool read_requestline(request_t *req, const char *line, size_t n) {
+    const char *pos = line;
+    const char *end = line + n;
+    char version[MAXLINE];
 
-        /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
-            return false;
-        }
+    if (next_word(&pos, end, req->method) == 0 ||
+        next_word(&pos, end, req->uri) == 0 ||
+        next_word(&pos, end, version) == 0) {
+        return true;
+    }
 
-        /* Parse header into name and value */
-        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
-            /* Error parsing header */
-            clienterror(client->connfd, "400", "Bad Request",
-                        "Proxy could not parse request headers");
-            return true;
-        }
+    /* version must be either HTTP/1.0 or HTTP/1.1 */
+    if (strncmp(version, "HTTP/1.", 7) != 0) {
+        return true;
     }
-    return false;
+    req->version = version[7];
+    return req->version != '0' && req->version != '1';
 }
 
 /* The following code has parts adapted from TINY server (tiny.c)
  *
- * read_requesthdrs - read HTTP request headers. If there is a host header,
- * then it puts it into host. If there is any headers besides Host,
- * User-Agent, Connection, and Proxy-Connection, then it combines them and
- * places them into rest
+ * read_requesthdr - parse one HTTP request header line, held in the n bytes
+ * at line, which is a view into the client's reader. If it is the host
+ * header, then it puts it into req->host_header. If it is any header besides
+ * Host, User-Agent, Connection, and Proxy-Connection, then it is appended to
+ * req->other_headers. Nothing else is copied
  *
  * Returns true if an error occurred, or false otherwise.
  */
-bool read_requesthdrs(client_info *client, rio_t *rp, char *host, char *rest) {
-    char buf[MAXLINE];
-    char name[MAXLINE];
-    char value[MAXLINE];
-    size_t prev_write = 0;
-
-    while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
-            return true;
-        }
-
-        /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
-            return false;
-        }
+bool read_requesthdr(client_info *client, const char *line, size_t n) {
+    request_t *req = client->req;
+    const char *end = line + n;
 
-        /* Parse header into name and value */
-        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
-            /* Error parsing header */
-            clienterror(client->connfd, "400", "Bad Request",
-                        "Proxy could not parse request headers");
-            return true;
-        }
-
-        if (strcmp(name, "Host") == 0) {
-            snprintf(host, MAXLINE, "%s: %s\r\n", name, value);
-        }
+    /* Parse header into name and value, which must both be non-empty */
+    const char *colon = memchr(line, ':', n);
+    const char *value = colon != NULL ? colon + 1 : end;
+    while (value < end && isspace((unsigned char)*value)) {
+        value++;
+    }
+    const char *value_end = value;
+    while (value_end < end && *value_end != '\r' && *value_end != '\n') {
+        value_end++;
+    }
+    if (colon == NULL || colon == line || value_end == value) {
+        /* Error parsing header */
+        clienterror(client, "400", "Bad Request",
+                    "Proxy could not parse request headers");
+        return true;
+    }
 
-        if (strcmp(name, "Host") != 0 && strcmp(name, "User-Agent") != 0 &&
-            strcmp(name, "Connection") != 0 &&
-            strcmp(name, "Proxy-Connection") != 0) {
-            prev_write += snprintf(rest + prev_write, MAXBUF - prev_write,
-                                   "%s: %s\r\n", name, value);
-        }
+    int name_len = colon - line;
+    int value_len = value_end - value;
+    if (name_is(line, name_len, "Host")) {
+        snprintf(req->host_header, MAXLINE, "%.*s: %.*s\r\n", name_len, line,
+                 value_len, value);
+    } else if (!name_is(line, name_len, "User-Agent") &&
+               !name_is(line, name_len, "Connection") &&
+               !name_is(line, name_len, "Proxy-Connection") &&
+               req->prev_write < MAXBUF) {
+        req->prev_write += snprintf(req->other_headers + req->prev_write,
+                                    MAXBUF - req->prev_write,
+                                    "%.*s: %.*s\r\n", name_len, line,
+                                    value_len, value);
     }
-    return host;
+    return false;
 }
 
 /* parses the the connection info from the URI
@@ -208,7 +312,7 @@ int get_conn_info(client_info *client, char *uri, char *hostname, char *port,
     if (res == 1) {
         dir[0] = '\0';
     } else if (res != 2) {
-        clienterror(client->connfd, "400", "malformed uri",
+        clienterror(client, "400", "malformed uri",
                     "proxy could not parse the uri");
         return -1;
     }
@@ -218,7 +322,7 @@ int get_conn_info(client_info *client, char *uri, char *hostname, char *port,
     if (res == 1) {
         snprintf(port, MAXLINE, "80");
     } else if (res != 2) {
-        clienterror(client->connfd, "400", "malformed url",
+        clienterror(client, "400", "malformed url",
                     "Proxy could not parse the URL");
         return -1;
     }
@@ -226,165 +330,953 @@ int get_conn_info(client_info *client, char *uri, char *hostname, char *port,
     return 0;
 }
 
-/* The following code contains pieces adapted from TINY server (tiny.c)
+/* Picks the size of the next relay read from the server socket fd, given
+ * that the last read of readlen bytes returned last bytes
  *
- * serve takes in a client_info*. It then creates a connection to the clients
- * requested server, and then returns the information from this server to the
- * client.
+ * Relaying starts with small reads, so small responses stay cheap. Once a
+ * read fills the whole buffer, the response is evidently streaming in faster
+ * than we drain it, so the size doubles, or jumps straight to what the
+ * kernel says is already queued on the socket (SIOCINQ), up to MAX_READLEN.
+ * A large transfer then takes a handful of syscalls instead of one read and
+ * one write per READLEN bytes
+ */
+size_t next_readlen(int fd, size_t readlen, size_t last) {
+    if (last < readlen || readlen >= MAX_READLEN) {
+        return readlen;
+    }
+
+    size_t want = readlen * 2;
+    int queued;
+    if (ioctl(fd, FIONREAD, &queued) == 0) {
+        while (want < (size_t)queued && want < MAX_READLEN) {
+            want *= 2;
+        }
+    }
+    return want < MAX_READLEN ? want : MAX_READLEN;
+}
+
+/* Frees req, along with its connector */
+void free_request(request_t *req) {
+    connector_free(req->conn);
+    free(req);
+}
+
+/* Builds the response to a request for METRICS_PATH into client->out */
+void metrics_response(client_info *client) {
+    size_t bodylen;
+    char *body = metrics_format(&bodylen);
+
+    char buf[MAXLINE];
+    size_t buflen = snprintf(buf, MAXLINE,
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n",
+                             bodylen);
+
+    client->log.status = 200;
+    free(client->out);
+    client->out = Malloc(buflen + bodylen);
+    memcpy(client->out, buf, buflen);
+    memcpy(client->out + buflen, body, bodylen);
+    client->outlen = buflen + bodylen;
+    free(body);
+}
+
+/* Writes the request of client to its server, like nbio_writen
  *
- * Requires that client contains valid information
+ * With TCP Fast Open (see sockopt.h) the request rides along with the SYN
+ * when the server knows us, and otherwise the write starts the handshake and
+ * fails with EINPROGRESS. Either way it just has to be retried once the
+ * socket is writable, so that is reported as EAGAIN
+ */
+ssize_t write_request(client_info *client) {
+    request_t *req = client->req;
+    ssize_t n = nbio_writen(client->serverfd, req->get_req, req->req_length,
+                            &client->outoff);
+    if (n < 0 && errno == EINPROGRESS) {
+        errno = EAGAIN;
+    }
+    return n;
+}
+
+/* Builds the request sent to the server for req into req->get_req */
+void build_request(request_t *req) {
+    /* Create Host key:value if not passed by client */
+    if (req->host_header[0] == '\0') {
+        snprintf(req->host_header, MAXLINE, "Host: %s:%s", req->hostname,
+                 req->port);
+    }
+
+    /* Create HTTP requst with headers */
+    req->req_length =
+        snprintf(req->get_req, sizeof(req->get_req),
+                 "GET /%s HTTP/1.0\r\n"
+                 "%s"
+                 "User-Agent: %s\r\n"
+                 "Connection: close\r\n"
+                 "Proxy-Connection: close\r\n"
+                 "%s\r\n",
+                 req->dir, req->host_header, header_user_agent,
+                 req->other_headers);
+}
+
+/* Returns the status code of the status line at the start of the n bytes at
+ * buf, or 0 if there isn't one
+ */
+int response_status(const char *buf, size_t n) {
+    const char *sp = memchr(buf, ' ', n);
+    if (n < 5 || strncmp(buf, "HTTP/", 5) != 0 || sp == NULL ||
+        buf + n - sp < 4) {
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i <= 3; i++) {
+        if (!isdigit((unsigned char)sp[i])) {
+            return 0;
+        }
+        status = status * 10 + sp[i] - '0';
+    }
+    return status;
+}
+
+/* Puts fd back into blocking mode */
+void set_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/* Writes the access log record of client, if it got as far as a request.
+ * Responses built by the proxy itself or served from the cache are counted
+ * from client->outoff
+ */
+void log_request(client_info *client) {
+    log_record_t *rec = &client->log;
+    if (rec->method[0] == '\0') {
+        return;
+    }
+
+    rec->bytes = client->out != NULL || client->hit != NULL ? client->outoff
+                                                            : client->res_total;
+    rec->duration = (metrics_now() - client->accepted) / 1000;
+    accesslog_write(rec);
+}
+
+/* Appends the n bytes at buf to the response kept for the cache, giving up
+ * on caching it once it grows past MAX_OBJECT_SIZE
+ */
+void keep_for_cache(client_info *client, const char *buf, size_t n) {
+    if (client->key == NULL) {
+        return;
+    }
+    if (client->cache_len + n > MAX_OBJECT_SIZE) {
+        free(client->key);
+        free(client->cache_buf);
+        client->key = NULL;
+        client->cache_buf = NULL;
+        return;
+    }
+
+    if (client->cache_len + n > client->cache_cap) {
+        size_t cap = client->cache_cap * 2;
+        cap = cap > client->cache_len + n ? cap : client->cache_len + n;
+        client->cache_cap = cap < MAX_OBJECT_SIZE ? cap : MAX_OBJECT_SIZE;
+        client->cache_buf = Realloc(client->cache_buf, client->cache_cap);
+    }
+    memcpy(client->cache_buf + client->cache_len, buf, n);
+    client->cache_len += n;
+}
+
+void prefetch(const char *url);
+
+/* Adds the complete response kept by client to the cache, if it may be.
+ * With prefetching on, the links of an HTML page that made it into the cache
+ * with a 200 status are fetched too, unless client is itself a prefetch, so
+ * prefetching never goes deeper than a page
+ */
+void store_in_cache(client_info *client) {
+    if (client->key == NULL) {
+        return;
+    }
+
+    // once cached, the page may be evicted and freed at any time, so links
+    // are looked for in a copy
+    char *uri = NULL;
+    char *page = NULL;
+    size_t len = client->cache_len;
+    if (prefetch_pages && !client->prefetch &&
+        response_status(client->cache_buf, len) == 200) {
+        uri = strdup(client->key);
+        page = Malloc(len);
+        memcpy(page, client->cache_buf, len);
+    }
+
+    if (add_obj(client->key, client->cache_buf, len, metrics_now())) {
+        client->key = NULL;
+        client->cache_buf = NULL;
+        if (page != NULL) {
+            prefetch_links(uri, page, len, prefetch);
+        }
+    }
+    free(uri);
+    free(page);
+}
+
+/* Checks whether the server of client could not be reached a moment ago
+ * (see add_host_error). If so, client->hit is set to what to serve instead:
+ * the stale object it already holds, if any, or the error from back then
  */
-void *serve(void *vargp) {
-    // get client var, detach thread
-    client_info *client = (client_info*)vargp;
-    pthread_detach(pthread_self());
-
-    // Get some extra info about the client (hostname/port)
-    int res = getnameinfo((SA *)&client->addr, client->addrlen, client->host,
-                          sizeof(client->host), client->serv,
-                          sizeof(client->serv), 0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
+bool host_down(client_info *client) {
+    request_t *req = client->req;
+    obj_t *error = get_host_error(req->hostname, req->port, metrics_now());
+    if (error == NULL) {
+        return false;
+    }
+
+    if (client->hit == NULL) {
+        client->hit = error;
     } else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+        done_with(error);
     }
+    return true;
+}
 
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
+/* Remembers the error built for client, whose server could not be reached,
+ * so the next requests for that server get it right away
+ */
+void remember_down(client_info *client) {
+    if (client->out == NULL) {
+        return;
+    }
 
-    /* Read request line */
-    char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
+    request_t *req = client->req;
+    char *error = Malloc(client->outlen);
+    memcpy(error, client->out, client->outlen);
+    if (!add_host_error(req->hostname, req->port, error, client->outlen,
+                        metrics_now())) {
+        free(error);
+    }
+}
+
+int serve(task_t *task);
+
+/* Creates the state of a background fetch of the request req, which it
+ * takes over. The fetch is a serve coroutine without a client, see serve
+ */
+client_info *new_fetch(request_t *req) {
+    client_info *fetch = Calloc(1, sizeof(client_info));
+    fetch->connfd = -1;
+    fetch->serverfd = -1;
+    fetch->accepted = metrics_now();
+    fetch->ticket = ADMIT_NO_SLOT;
+    fetch->req = req;
+    fetch->task.fn = serve;
+    return fetch;
+}
+
+/* Starts a background task refreshing the stale object obj, which the
+ * caller has claimed with claim_refresh, by sending the request of client
+ * again
+ */
+void refresh_obj(client_info *client, obj_t *obj) {
+    request_t *req = Malloc(sizeof(request_t));
+    memcpy(req, client->req, sizeof(request_t));
+    client_info *fetch = new_fetch(req);
+    fetch->refresh = obj;
+    loop_spawn(&fetch->task);
+}
+
+/* Creates the state of a background fetch of uri
+ *
+ * Returns it, or NULL if uri is malformed
+ */
+client_info *fetch_uri(const char *uri) {
+    request_t *req = Calloc(1, sizeof(request_t));
+    client_info *fetch = new_fetch(req);
+    snprintf(req->uri, MAXLINE, "%s", uri);
+    if (get_conn_info(fetch, req->uri, req->hostname, req->port, req->dir) <
+        0) {
+        free(fetch->out);
+        free(fetch);
+        free(req);
         return NULL;
     }
 
-    /* Parse the request line and check if it's well-formed */
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char version;
+    build_request(req);
+    return fetch;
+}
 
-    /* sscanf must parse exactly 3 things for request line to be well-formed */
-    /* version must be either HTTP/1.0 or HTTP/1.1 */
-    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3 ||
-        (version != '0' && version != '1')) {
-        clienterror(client->connfd, "400", "Bad Request",
+/* Starts fetching uri into the cache in the background, for warmup.h
+ *
+ * Returns true if the fetch was started, or false if uri is malformed
+ */
+bool warm(const char *uri) {
+    client_info *fetch = fetch_uri(uri);
+    if (fetch == NULL) {
+        return false;
+    }
+    fetch->warmup = true;
+    loop_spawn(&fetch->task);
+    return true;
+}
+
+/* Starts fetching the link url of a page into the cache in the background,
+ * for prefetch.h. Links that are already fresh in the cache are skipped, and
+ * so are all links while PREFETCH_MAX_INFLIGHT fetches are running, which
+ * keeps prefetching from crowding out the clients
+ */
+void prefetch(const char *url) {
+    if (cache_fresh(url, metrics_now())) {
+        return;
+    }
+    if (__atomic_add_fetch(&prefetching, 1, __ATOMIC_RELAXED) >
+        PREFETCH_MAX_INFLIGHT) {
+        __atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    client_info *fetch = fetch_uri(url);
+    if (fetch == NULL) {
+        __atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    fetch->prefetch = true;
+    loop_spawn(&fetch->task);
+}
+
+/* Notes that client just made progress, for the idle deadline */
+void touch(client_info *client) {
+    __atomic_store_n(&client->last_active, metrics_now(), __ATOMIC_RELAXED);
+}
+
+/* Returns the time (see metrics.h) by which client has missed a deadline,
+ * or UINT64_MAX if there is none
+ */
+uint64_t client_due(client_info *client) {
+    uint64_t due = __atomic_load_n(&client->deadline, __ATOMIC_RELAXED);
+    if (timeout_opts.idle > 0) {
+        uint64_t idle =
+            __atomic_load_n(&client->last_active, __ATOMIC_RELAXED) +
+            timeout_opts.idle * NSEC_PER_SEC;
+        due = idle < due ? idle : due;
+    }
+    return due;
+}
+
+/* Returns the milliseconds from now until due, rounded up */
+unsigned ms_until(uint64_t due, uint64_t now) {
+    uint64_t ms = (due - now + 999999) / 1000000;
+    return ms < UINT_MAX ? ms : UINT_MAX;
+}
+
+/* Checks the deadlines of a client when its timer expires (see loop.h)
+ *
+ * This runs concurrently with serve, so it only reads the times serve keeps
+ * up to date. When a deadline has passed it shuts down the sockets, which
+ * makes whatever serve is waiting on fail, and serve cleans up as usual.
+ * A lookup has no socket to shut down, so it is cancelled instead, and serve
+ * answers 504 before the sockets are shut down after all
+ */
+unsigned client_timeout(loop_timer_t *timer) {
+    client_info *client =
+        (client_info *)((char *)timer - offsetof(client_info, timer));
+    uint64_t now = metrics_now();
+    uint64_t due = client_due(client);
+    if (now < due) {
+        return ms_until(due, now);
+    }
+
+    metrics_count(METRIC_TIMEOUTS, 1);
+    lookup_t *lookup = __atomic_load_n(&client->lookup, __ATOMIC_ACQUIRE);
+    if (lookup != NULL && resolver_cancel(lookup)) {
+        return LOOKUP_GRACE_MS;
+    }
+    if (client->connfd >= 0) {
+        shutdown(client->connfd, SHUT_RDWR);
+    }
+    int serverfd = __atomic_load_n(&client->serverfd, __ATOMIC_RELAXED);
+    if (serverfd >= 0) {
+        shutdown(serverfd, SHUT_RDWR);
+    }
+    return 0;
+}
+
+/* Sets the deadline of the current stage of client to secs seconds after it
+ * was accepted, or none if secs is 0
+ */
+void set_deadline(client_info *client, int secs) {
+    uint64_t deadline =
+        secs > 0 ? client->accepted + secs * NSEC_PER_SEC : UINT64_MAX;
+    __atomic_store_n(&client->deadline, deadline, __ATOMIC_RELAXED);
+}
+
+/* The following code contains pieces adapted from TINY server (tiny.c)
+ *
+ * serve is the coroutine serving a client_info. It reads the client's
+ * request, then creates a connection to the clients requested server, and
+ * then returns the information from this server to the client.
+ *
+ * It runs on an event loop (see loop.h), so every read, write and connect
+ * is non-blocking, and waits for its descriptor with TASK_AWAIT_IO instead.
+ * The deadlines in timeout.h are enforced by a timer, see client_timeout.
+ * The end of every stage of a request is marked with PROFILE_TRACE, see
+ * profile.h.
+ *
+ * Responses are served from the cache when possible, and complete responses
+ * no bigger than MAX_OBJECT_SIZE are added to it. Stale objects are served
+ * right away while a background task refreshes them: that task is serve
+ * itself, with the request already filled in and no client (connfd is -1),
+ * which just fetches the response into the cache. Cache warmup (see
+ * warmup.h) and link prefetching (see prefetch.h) use the same background
+ * fetches. Objects that are past
+ * that, but still within their stale-if-error lifetime, are kept around and
+ * served if the server cannot be reached.
+ *
+ * Requires that client contains valid information
+ */
+int serve(task_t *task) {
+    client_info *client = (client_info *)task;
+    request_t *req = client->req;
+    char *line;
+    bool bad;
+    ssize_t n;
+    int res;
+    uint64_t due;
+    uint64_t now;
+    cache_state state;
+    size_t readlen;
+
+    CO_BEGIN(task->co);
+
+    /* The whole request has to arrive by the header deadline, except for a
+       background fetch, which already has it */
+    set_deadline(client, client->connfd < 0 ? timeout_opts.total
+                                            : timeout_opts.header);
+    client->last_active = client->accepted;
+    due = client_due(client);
+    if (due != UINT64_MAX) {
+        timer_start(task, &client->timer, ms_until(due, client->accepted),
+                    client_timeout);
+    }
+    if (client->connfd < 0) {
+        client->key = strdup(req->uri);
+        goto fetch;
+    }
+
+    client->req = req = Calloc(1, sizeof(request_t));
+    nbio_readinitb(&client->rio, client->connfd);
+
+    /* Read request line, parsing it right where it sits in the reader */
+    TASK_AWAIT_IO(task, n, client->connfd, EPOLLIN,
+                  nbio_peekline(&client->rio, &line));
+    if (n <= 0) {
+        goto done;
+    }
+
+    /* Parse the request line and check if it's well-formed */
+    bad = read_requestline(req, line, n);
+    nbio_consume(&client->rio, n);
+    accesslog_request(&client->log, req->method, req->uri);
+    if (bad) {
+        clienterror(client, "400", "Bad Request",
                     "Proxy received a malformed request");
-        return NULL;
+        goto reply;
     }
 
     /* Check that the method is GET */
-    if (strcmp(method, "GET") != 0) {
-        clienterror(client->connfd, "501", "Not Implemented",
+    if (strcmp(req->method, "GET") != 0) {
+        clienterror(client, "501", "Not Implemented",
                     "Proxy does not implement this method");
-        return NULL;
+        goto reply;
     }
+    metrics_count(METRIC_REQUESTS, 1);
 
-    char host_header[MAXBUF];
-    char other_headers[MAXBUF];
-    host_header[0] = '\0';
-    /* Check if reading request headers caused an error, and read Host header
-       into host_header, as well as any other extraneous headers  */
-    if (read_requesthdrs(client, &rio, host_header, other_headers)) {
-        return NULL;
+    /* Read the request headers, keeping the Host header in host_header, as
+       well as any other extraneous headers in other_headers */
+    while (true) {
+        TASK_AWAIT_IO(task, n, client->connfd, EPOLLIN,
+                      nbio_peekline(&client->rio, &line));
+        if (n <= 0) {
+            goto done;
+        }
+        touch(client);
+
+        /* Check for end of request headers */
+        if (name_is(line, n, "\r\n")) {
+            nbio_consume(&client->rio, n);
+            break;
+        }
+
+        bad = read_requesthdr(client, line, n);
+        nbio_consume(&client->rio, n);
+        if (bad) {
+            goto reply;
+        }
     }
 
-    /* Determine connection port, hostname and directory*/
-    char port[MAXLINE];
-    char dir[MAXLINE];
-    char hostname[MAXLINE];
-    if ((res = get_conn_info(client, uri, hostname, port, dir)) < 0) {
-        return NULL;
+    PROFILE_TRACE(PARSED, &client->traced);
+
+    /* From here on the rest of the request has to be served in time */
+    set_deadline(client, timeout_opts.total);
+
+    /* Requests for the proxy itself */
+    if (strcmp(req->uri, METRICS_PATH) == 0) {
+        metrics_response(client);
+        goto reply;
     }
 
-    /* Establish connection with server */
-    int serverfd;
-    if ((serverfd = open_clientfd(hostname, port)) < 0) {
-        clienterror(client->connfd, "400", "Proxy cannot reach destination",
-                    "Proxy could not conacnt destination server");
-        return NULL;
+    /* Determine connection port, hostname and directory*/
+    if (get_conn_info(client, req->uri, req->hostname, req->port, req->dir) <
+        0) {
+        goto reply;
     }
 
-    rio_t s_rio;
-    rio_readinitb(&s_rio, serverfd);
+    build_request(req);
 
-    /* Create Host key:value if not passed by client */
-    if (host_header[0] == '\0') {
-        snprintf(host_header, MAXLINE, "Host: %s:%s", hostname, port);
+    /* Serve fresh and stale objects from the cache, and keep anything older
+       around in case the server cannot be reached */
+    now = metrics_now();
+    client->hit = get_obj(req->uri, now);
+    state = client->hit != NULL ? obj_state(client->hit, now)
+                                : CACHE_ERROR_ONLY;
+    if (state == CACHE_STALE && claim_refresh(client->hit)) {
+        refresh_obj(client, client->hit);
+    }
+    if (state != CACHE_ERROR_ONLY) {
+        goto hit;
     }
+    client->key = strdup(req->uri);
 
-    /* Create HTTP requst with headers */
-    char get_req[MAXBUF];
-    size_t req_length =
-        snprintf(get_req, sizeof(get_req),
-                 "GET /%s HTTP/1.0\r\n"
-                 "%s"
-                 "User-Agent: %s\r\n"
-                 "Connection: close\r\n"
-                 "Proxy-Connection: close\r\n"
-                 "%s\r\n",
-                 dir, host_header, header_user_agent, other_headers);
+fetch:
+    /* Hosts that could not be reached a moment ago are not tried again */
+    if (client->connfd >= 0 && host_down(client)) {
+        goto hit;
+    }
 
-    printf("Resonse Headers: %s\n", get_req);
+    /* Get a list of potential server addresses, without blocking the loop */
+    __atomic_store_n(&client->lookup,
+                     resolver_lookup(req->hostname, req->port),
+                     __ATOMIC_RELEASE);
+    TASK_AWAIT_IO(task, res, client->lookup->fd, EPOLLIN,
+                  resolver_poll(client->lookup));
+    if (client->lookup->cancelled) {
+        goto lookup_timeout;
+    }
+    if (client->lookup->error != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", req->hostname,
+                req->port, gai_strerror(client->lookup->error));
+    }
+
+    /* Establish connection with server, racing its addresses */
+    client->stage_start = metrics_now();
+    req->conn =
+        connector_new(client->lookup->addrs, timeout_opts.connect * 1000);
+    TASK_AWAIT_IO(task, client->serverfd, req->conn->connfd, EPOLLIN,
+                  connector_poll(req->conn));
+    if (client->serverfd < 0) {
+        goto unreachable;
+    }
 
-    /* Send the request to the server */
-    if (rio_writen(serverfd, get_req, req_length) < 0) {
+    /* Send the request to the server. Only then is the connect known to have
+       worked, since with TCP Fast Open the handshake starts here */
+    client->outoff = 0;
+    TASK_AWAIT_IO(task, n, client->serverfd, EPOLLOUT,
+                  write_request(client));
+    if (n < 0 && client->outoff == 0) {
+        /* With TCP Fast Open, this is where a failed connect shows up */
+        goto unreachable;
+    }
+    if (n < 0) {
         fprintf(stderr, "Error writing to server\n");
-        close(serverfd);
-        return NULL;
+        goto done;
+    }
+    metrics_since(METRIC_CONNECT, client->stage_start);
+    PROFILE_TRACE(CONNECTED, &client->traced);
+    client->stage_start = metrics_now();
+
+    /* The request and the stale fallback are no longer needed while
+       relaying */
+    free_request(req);
+    client->req = NULL;
+    if (client->hit != NULL) {
+        done_with(client->hit);
+        client->hit = NULL;
     }
 
-    // use calloc to 0 out
-    char *res_buf = Calloc((MAX_OBJECT_SIZE) + MAXBUF, 1);
+    /* Whatever the server reader has not buffered is read straight into
+       res_buf, so relayed bytes are only copied out of the kernel once */
+    client->readlen = READLEN;
+    client->res_buf = Malloc(client->readlen);
+    nbio_readinitb(&client->srio, client->serverfd);
+    while (true) {
+        /* Once the response cannot be cached, let the io_uring relay loops
+           move the rest of it. They own the fds from then on, enforce the
+           deadlines and log the request */
+        if (use_uring && client->key == NULL && client->connfd >= 0) {
+            timer_stop(&client->timer);
+            resolver_free(client->lookup);
+            task_forget(task, client->connfd);
+            task_forget(task, client->serverfd);
+            set_blocking(client->connfd);
+            set_blocking(client->serverfd);
+            client->log.bytes = client->res_total;
+            uring_relay(client->connfd, client->serverfd, client->accepted,
+                        client->stage_start, client->ticket, &client->log);
+            nbio_free(&client->rio);
+            nbio_free(&client->srio);
+            free(client->res_buf);
+            free(client);
+            return CO_DONE;
+        }
+
+        TASK_AWAIT_IO(task, n, client->serverfd, EPOLLIN,
+                      nbio_readb(&client->srio, client->res_buf,
+                                 client->readlen));
+        if (n <= 0) {
+            if (n == 0) {
+                store_in_cache(client);
+            }
+            break;
+        }
+        touch(client);
+        if (client->stage_start != 0) {
+            metrics_since(METRIC_TTFB, client->stage_start);
+            client->stage_start = 0;
+            client->log.status = response_status(client->res_buf, n);
+        }
+        keep_for_cache(client, client->res_buf, n);
+        client->res_len = n;
+
+        /* A background fetch only fills the cache, and gives up as soon as
+           the response turns out to be too big for it */
+        if (client->connfd < 0) {
+            if (client->key == NULL) {
+                break;
+            }
+            continue;
+        }
+
+        client->outoff = 0;
+        TASK_AWAIT_IO(task, n, client->connfd, EPOLLOUT,
+                      nbio_writen(client->connfd, client->res_buf,
+                                  client->res_len, &client->outoff));
+        if (n < 0) {
+            fprintf(stderr, "Error writing to client\n");
+            break;
+        }
+        touch(client);
+        if (client->res_total == 0) {
+            metrics_since(METRIC_FIRST_BYTE, client->accepted);
+            admit_observe(client->accepted);
+            PROFILE_TRACE(FIRST_BYTE, &client->traced);
+        }
+        client->res_total += client->res_len;
+        metrics_count(METRIC_BYTES, client->res_len);
 
-    int bytes_in;
-    while ((bytes_in = rio_readnb(&s_rio, res_buf, READLEN)) != 0) {
-        if (rio_writen(client->connfd, res_buf, bytes_in) < 0) {
-            fprintf(stderr, "Error writing to server\n");
-            close(serverfd);
-            return NULL;
+        /* Grow the reads while the server keeps filling them up */
+        readlen =
+            next_readlen(client->serverfd, client->readlen, client->res_len);
+        if (readlen != client->readlen) {
+            client->res_buf = Realloc(client->res_buf, readlen);
+            client->readlen = readlen;
         }
-        memset(res_buf, 0, bytes_in);
     }
+    goto done;
 
+hit:
+    /* Send the cached response, then hang up */
+    if (obj_state(client->hit, metrics_now()) != CACHE_FRESH) {
+        metrics_count(METRIC_CACHE_STALE, 1);
+    }
+    client->log.status =
+        response_status(client->hit->buf, client->hit->size);
+    client->outoff = 0;
+    TASK_AWAIT_IO(task, n, client->connfd, EPOLLOUT,
+                  nbio_writen(client->connfd, client->hit->buf,
+                              client->hit->size, &client->outoff));
+    if (n >= 0) {
+        metrics_since(METRIC_FIRST_BYTE, client->accepted);
+        admit_observe(client->accepted);
+        metrics_count(METRIC_BYTES, client->hit->size);
+        PROFILE_TRACE(FIRST_BYTE, &client->traced);
+    }
+    goto done;
+
+lookup_timeout:
+    /* The deadline passed while looking the server up, see client_timeout.
+       Nothing is known about the host, so it is not remembered as down */
+    if (client->hit != NULL) {
+        goto hit;
+    }
+    clienterror(client, "504", "Gateway Timeout",
+                "Proxy timed out looking up destination server");
+    goto reply;
+
+unreachable:
+    /* Serve the stale object kept for this, if there is one, and otherwise
+       an error, which is remembered for the host */
+    if (client->hit != NULL) {
+        goto hit;
+    }
+    clienterror(client, "400", "Proxy cannot reach destination",
+                "Proxy could not conacnt destination server");
+    remember_down(client);
+
+reply:
+    /* Send the response built by clienterror or metrics_response, then hang
+       up. A background fetch has nobody to tell */
+    if (client->connfd < 0) {
+        goto done;
+    }
+    client->outoff = 0;
+    TASK_AWAIT_IO(task, n, client->connfd, EPOLLOUT,
+                  nbio_writen(client->connfd, client->out, client->outlen,
+                              &client->outoff));
 
-    //cleanup fds and client
-    close(serverfd);
-    close(client->connfd);
+done:
+    //cleanup fds and client, once the timer can no longer touch them
+    timer_stop(&client->timer);
+    resolver_free(client->lookup);
+    if (client->connfd >= 0) {
+        metrics_since(METRIC_TOTAL, client->accepted);
+        PROFILE_TRACE(DONE, &client->traced);
+        log_request(client);
+        admit_release(client->ticket);
+        close(client->connfd);
+    }
+    if (client->serverfd >= 0) {
+        close(client->serverfd);
+    }
+    if (client->req != NULL) {
+        free_request(client->req);
+    }
+    if (client->hit != NULL) {
+        done_with(client->hit);
+    }
+    if (client->refresh != NULL) {
+        refresh_done(client->refresh);
+    }
+    if (client->warmup) {
+        warmup_done();
+    }
+    if (client->prefetch) {
+        __atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+    }
+    free(client->key);
+    free(client->cache_buf);
+    nbio_free(&client->rio);
+    nbio_free(&client->srio);
+    free(client->out);
+    free(client->res_buf);
     free(client);
-    free(res_buf);
+    return CO_DONE;
 
-    return NULL;
+    CO_END(task->co);
+}
+
+/* Creates the coroutine to serve a newly accepted connection, or turns it
+ * away if admission control says so
+ */
+task_t *new_client(int connfd, struct sockaddr *addr, socklen_t addrlen) {
+    admit_ticket_t ticket;
+    metrics_count(METRIC_CONNECTIONS, 1);
+    if (!admit(addr, &ticket)) {
+        admit_reject(connfd);
+        return NULL;
+    }
+
+    // allocate space for client struct on heap, zeroed out
+    client_info *client = Calloc(1, sizeof(client_info));
+    memcpy(&client->addr, addr, addrlen);
+    client->addrlen = addrlen;
+    client->connfd = connfd;
+    client->serverfd = -1;
+    client->accepted = metrics_now();
+    client->traced = client->accepted;
+    PROFILE_PROBE(ACCEPT);
+    client->ticket = ticket;
+    accesslog_addr(&client->log, addr);
+    client->task.fn = serve;
+    return &client->task;
+}
+
+/* Schedules a connection accepted by the io_uring backend on a loop */
+void serve_accepted(int connfd) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    getpeername(connfd, (SA *)&addr, &addrlen);
+
+    int flags = fcntl(connfd, F_GETFL, 0);
+    fcntl(connfd, F_SETFL, flags | O_NONBLOCK);
+
+    task_t *task = new_client(connfd, (SA *)&addr, addrlen);
+    if (task != NULL) {
+        loop_spawn(task);
+    }
+}
+
+/* Raises the limit on open descriptors as far as we are allowed to, since
+ * every connection being served holds two of them
+ */
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Prints usage information and exits */
+void usage(const char *prog) {
+    printf("Usage: %s [-u] [-p] [-n loops] [-l file] [-w file] "
+           "[--profile file] [-a name=value]... [-s name=value]... "
+           "[-t name=value]... [-c name=value]... port\n",
+           prog);
+    printf("  -u        Use the io_uring backend for accepting, and for "
+           "relaying\n");
+    printf("            the rest of responses too big for the cache\n");
+    printf("  -p        Prefetch the images, scripts and styles of pages\n");
+    printf("  -P file, --profile file\n");
+    printf("            Sample where CPU time goes, and write the stacks to "
+           "file,\n");
+    printf("            in folded form, when stopped by SIGINT or SIGTERM\n");
+    printf("  -n loops  Number of event loop threads (default: cores)\n");
+    printf("  -l file   Write an access log to file, or stdout if it is -\n");
+    printf("  -w file   Warm the cache up from a file of URLs or a log\n");
+    printf("  -a name=value  Set an admission control option, one of:\n");
+    admit_usage();
+    printf("  -s name=value  Set a socket option, one of:\n");
+    sockopt_usage();
+    printf("  -t name=value  Set a deadline, one of:\n");
+    timeout_usage();
+    printf("  -c name=value  Set a default cache lifetime, one of:\n");
+    cache_usage();
+    exit(1);
 }
 
 int main(int argc, char **argv) {
 
     Signal(SIGPIPE, SIG_IGN);
 
+    int nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *warmup_path = NULL;
+    const char *profile_path = NULL;
+    const char *log_path = NULL;
+    static const struct option long_opts[] = {
+        {"profile", required_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "upP:n:l:w:a:s:t:c:", long_opts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'u':
+            use_uring = true;
+            break;
+        case 'p':
+            prefetch_pages = true;
+            break;
+        case 'P':
+            profile_path = optarg;
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        case 'w':
+            warmup_path = optarg;
+            break;
+        case 'a':
+            if (admit_parse(optarg) < 0) {
+                printf("Unknown admission option %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            if (sockopt_parse(optarg) < 0) {
+                printf("Unknown socket option %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            if (timeout_parse(optarg) < 0) {
+                printf("Unknown deadline %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (cache_parse(optarg) < 0) {
+                printf("Unknown cache option %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
     /*check if a port was passed */
-    if (argc != 2) {
+    if (optind != argc - 1) {
         printf("Please pass a port to wait for connections on\n");
-        exit(1);
+        usage(argv[0]);
     }
 
-    int listenfd = open_listenfd(argv[1]);
+    int listenfd = sockopt_listen(argv[optind]);
     if (listenfd < 0) {
-        printf("Failed to listen on port %s\n", argv[1]);
+        printf("Failed to listen on port %s\n", argv[optind]);
+        exit(1);
     }
 
-    int clientfd;
-    while (1) {
-        // allocate space for client struct on heap
-        client_info *client = Malloc(sizeof(client_info));
+    /* Profile before any other thread exists, see profile.h */
+    if (profile_path != NULL && profile_start(profile_path) < 0) {
+        printf("Failed to open profile %s\n", profile_path);
+        exit(1);
+    }
 
-        // accept connection
-        clientfd = accept(listenfd, (SA *)&client->addr, &client->addrlen);
+    /* The access log has a thread of its own, so it starts after profiling */
+    if (log_path != NULL && accesslog_open(log_path) < 0) {
+        printf("Failed to open access log %s\n", log_path);
+        exit(1);
+    }
+
+    raise_fd_limit();
+    admit_init();
+    cache_init();
+    if (resolver_init() < 0) {
+        printf("Failed to start the resolver threads\n");
+        exit(1);
+    }
 
-        //if valid clientfd, then create a thread and serve
-        if (clientfd >= 0) {
-            client->connfd = clientfd;
-            pthread_t tid;
-            pthread_create(&tid, NULL, &serve, (void*)client);
+    /* Start one io_uring relay loop per core, falling back if unsupported */
+    if (use_uring && uring_init(nloops) < 0) {
+        fprintf(stderr, "io_uring unavailable, using the epoll loops\n");
+        use_uring = false;
+    }
+
+    /* Without io_uring, the event loops accept connections themselves */
+    loop_init(nloops, use_uring ? -1 : listenfd, new_client);
+
+    /* Warm the cache up alongside serving */
+    if (warmup_path != NULL && warmup_start(warmup_path, warm) < 0) {
+        printf("Failed to open warmup file %s\n", warmup_path);
+        exit(1);
+    }
+
+    if (use_uring) {
+        /* Only returns if the accept ring could not be set up */
+        uring_accept_loop(listenfd, serve_accepted);
+
+        while (1) {
+            int connfd = accept(listenfd, NULL, NULL);
+            if (connfd >= 0) {
+                serve_accepted(connfd);
+            }
         }
     }
+
+    // the event loops do all the work from here on
+    pthread_exit(NULL);
     return 0;
 }
@@ -328,6 +328,8 @@ class Server:
         self.httpStatus = HTTPStatus()
         self.requestCount = 0
         self.readingHeader = False
+        # Value of the Cache-Control header of responses, if any
+        self.cacheControl = None
         self.timeOut = 1.0
         self.allOK = True
         self.disruption = Disruption.none
@@ -485,6 +487,8 @@ class Server:
             lines.append("Request-ID: %s\r\n" % id)
         lines.append("Content-length: %d\r\n" % length)
         lines.append("Content-type: %s\r\n" % mimeType)
+        if self.cacheControl is not None:
+            lines.append("Cache-Control: %s\r\n" % self.cacheControl)
         if id != "" and uri is not None:
             lines.append("Content-Identifier: %s-%s\r\n" % (self.id, uri))
         lines.append("Sequence-Identifier: %s\r\n" % self.sequenceId())
@@ -818,6 +822,7 @@ class RequestGenerator:
             self.errMsg("Couldn't get address information for %s:%d" % (phost, pport))
             return False
         sock = None
+        event.startTime = self.eventManager.now()
         for info in tuples:
             (family, socktype, proto, canonname, sockaddr) = info
             try:
@@ -982,6 +987,8 @@ class RequestGenerator:
                 outfile.write(buf)
             remaining -= len(buf)
             self.eventManager.changeTag(event, "reading", "Client expecting %d more bytes (total %d) from proxy" % (remaining, length))
+        event.finishTime = self.eventManager.now()
+        event.bytes = length
         self.eventManager.changeTag(event, "closing", "Client closing connection to proxy")
         self.eventManager.addBeat("closing")
         outfile.close()
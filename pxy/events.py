@@ -49,6 +49,10 @@ class Event:
     pendingHeaderLines = []
     sentHeaderLines = []
     receivedHeaderLines = []
+    # Timing of requests.  Seconds relative to start of event manager
+    startTime = None   # When client started connecting to proxy
+    finishTime = None  # When client had read entire response
+    bytes = 0          # Length of response body
 
     def __init__(self, isRequest, time, id, path = "", text = "", server = "", isFetch = False):
         self.isRequest = isRequest
@@ -71,6 +75,15 @@ class Event:
         self.pendingHeaderLines = []
         self.sentHeaderLines = []
         self.receivedHeaderLines = []
+        self.startTime = None
+        self.finishTime = None
+        self.bytes = 0
+
+    # Time taken by request (in seconds), or None if not yet complete
+    def latency(self):
+        if self.startTime is None or self.finishTime is None:
+            return None
+        return self.finishTime - self.startTime
 
     def addText(self, text):
         self.text += text
@@ -156,6 +169,10 @@ class EventManager:
         self.running = True
         self.heartbeatManager = None
 
+    # Seconds since start of event manager
+    def now(self):
+        return elapsedSeconds(self.startTime)
+
     def addRequestEvent(self, id = "", server = "", isFetch = False):
         return self.addEvent(True, id, server = server, isFetch = isFetch)
 
@@ -304,6 +321,13 @@ class EventManager:
         for e in ls:
             e.finishShutdown()
 
+    # List of all request events, ordered by time
+    def requestEvents(self):
+        self.mutex.acquire()
+        ls = [e for e in self.list if e.isRequest]
+        self.mutex.release()
+        return ls
+
     def stringList(self):
         self.mutex.acquire()
         ls = [str(e) for e in self.list]
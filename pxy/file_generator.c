@@ -0,0 +1,506 @@
+/*
+ * Proxylab testing framework
+ * Generator for files of random text or binary data
+ *
+ * Text files consist of lines of LINE_LENGTH printable characters, each
+ * followed by a line feed. Binary files consist of random bytes, of which
+ * a given percentage are null characters and a given percentage are line
+ * feeds.
+ *
+ * The contents come from a counter-based generator: every 64-bit word is a
+ * hash of the seed and its offset in the file, so any part of a file can be
+ * produced independently of the rest, and no iteration of the inner loop
+ * depends on another, which leaves the compiler free to vectorize it. Files
+ * are sized with ftruncate, which leaves them sparse, then mapped and filled
+ * in place by several threads, each taking CHUNK_SIZE bytes at a time. The
+ * seed is a hash of the path, so a file has the same contents however many
+ * threads write it.
+ *
+ * With -c, a corpus of files is generated in the directory PATH instead.
+ * Their sizes follow a Zipf distribution of exponent SALPHA and add up to
+ * about BYTES. With -r, a trace of requests to the corpus whose popularity
+ * follows a Zipf distribution of exponent PALPHA is also written to
+ * PATH/trace, in the format read by bench/cachesim.
+ *
+ * Usage: file_generator -p PATH -n BYTES [-b] [-z ZPCT] [-l LPCT]
+ *                       [-c COUNT [-s SALPHA] [-r REQUESTS [-a PALPHA]]
+ *                       [-u URL]] [-t THREADS]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// characters of text files, and length of their lines
+#define LOW_CHAR ' '
+#define HIGH_CHAR '~'
+#define LINE_LENGTH 80
+
+// bytes of a file filled by a thread at a time
+#define CHUNK_SIZE (1 << 20)
+
+// most threads used
+#define MAX_THREADS 256
+
+// requests per second of a trace
+#define TRACE_RATE 1000
+
+#define GOLDEN 0x9e3779b97f4a7c15ull
+
+/* Type for a file to generate */
+typedef struct {
+    char *path;
+    size_t size;
+} gen_file_t;
+
+/* Type for the work shared by the threads
+ *
+ * With one file, threads take chunks of it, and with several, whole files
+ */
+typedef struct {
+    gen_file_t *files;
+    size_t nfiles;
+    char *map;              // mapping of the file, when there is only one
+    uint64_t seed;          // seed of the file, when there is only one
+    size_t next;            // next chunk or file to take
+    bool failed;
+} work_t;
+
+static bool binary = false;
+static uint32_t zero_limit; // 16-bit thresholds for null and line feed bytes
+static uint32_t lf_limit;
+
+/* Mixes x into a random 64-bit word (splitmix64) */
+static inline uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/* Returns the seed of the file at path (FNV-1a) */
+static uint64_t path_seed(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Fills buf with the len bytes of a file found at offset off
+ *
+ * off must be a multiple of 4. Every word yields 2 binary bytes or 4 text
+ * characters, each from 16 random bits
+ */
+static void fill(char *buf, size_t off, size_t len, uint64_t seed) {
+    size_t per_word = binary ? 2 : 4;
+    for (size_t i = 0; i < len; i += per_word) {
+        uint64_t word = mix(seed + ((off + i) / per_word) * GOLDEN);
+        size_t n = len - i < per_word ? len - i : per_word;
+        for (size_t j = 0; j < n; j++) {
+            size_t pos = off + i + j;
+            if (binary) {
+                uint32_t bits = (uint32_t)(word >> (32 * j));
+                uint32_t pick = bits >> 16;
+                buf[i + j] = pick < zero_limit ? '\0'
+                             : pick < lf_limit ? '\n'
+                                               : (char)bits;
+            } else if (pos % (LINE_LENGTH + 1) == LINE_LENGTH) {
+                buf[i + j] = '\n';
+            } else {
+                uint32_t bits = (uint16_t)(word >> (16 * j));
+                buf[i + j] = LOW_CHAR +
+                             (char)((bits * (HIGH_CHAR - LOW_CHAR + 1)) >> 16);
+            }
+        }
+    }
+}
+
+/* Creates the file at path with size bytes, and maps it
+ *
+ * Returns the mapping, NULL for an empty file, or MAP_FAILED on error
+ */
+static char *map_file(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return MAP_FAILED;
+    }
+    char *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return map;
+}
+
+/* Creates and fills a whole file
+ *
+ * Returns whether it succeeded
+ */
+static bool generate_file(const gen_file_t *file) {
+    char *map = map_file(file->path, file->size);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (map != NULL) {
+        fill(map, 0, file->size, path_seed(file->path));
+        munmap(map, file->size);
+    }
+    return true;
+}
+
+/* Thread routine, doing work until there is none left */
+static void *worker(void *vargp) {
+    work_t *work = vargp;
+    if (work->nfiles == 1) {
+        size_t size = work->files[0].size;
+        size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t c;
+        while ((c = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+               chunks) {
+            size_t off = c * CHUNK_SIZE;
+            size_t len = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+            fill(work->map + off, off, len, work->seed);
+        }
+        return NULL;
+    }
+
+    size_t f;
+    while ((f = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+           work->nfiles) {
+        if (!generate_file(&work->files[f])) {
+            fprintf(stderr, "Could not generate file %s (%s)\n",
+                    work->files[f].path, strerror(errno));
+            __atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Generates the nfiles files using nthreads threads
+ *
+ * Returns whether it succeeded
+ */
+static bool generate(gen_file_t *files, size_t nfiles, int nthreads) {
+    work_t work = {.files = files, .nfiles = nfiles};
+    if (nfiles == 1) {
+        work.map = map_file(files[0].path, files[0].size);
+        if (work.map == MAP_FAILED) {
+            fprintf(stderr, "Could not generate file %s (%s)\n",
+                    files[0].path, strerror(errno));
+            return false;
+        }
+        work.seed = path_seed(files[0].path);
+    }
+
+    pthread_t tids[nthreads];
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&tids[started], NULL, worker, &work) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        worker(&work);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (nfiles == 1 && work.map != NULL) {
+        munmap(work.map, files[0].size);
+    }
+    return !work.failed;
+}
+
+/* Returns the weights of ranks 1 to n of a Zipf distribution of exponent
+ * alpha, and stores their sum in *total
+ */
+static double *zipf_weights(size_t n, double alpha, double *total) {
+    double *weights = malloc(n * sizeof(double));
+    if (weights == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *total = 0;
+    for (size_t k = 0; k < n; k++) {
+        weights[k] = pow((double)(k + 1), -alpha);
+        *total += weights[k];
+    }
+    return weights;
+}
+
+/* Builds a corpus of count files in directory dir, whose sizes follow a
+ * Zipf distribution of exponent alpha and add up to about bytes
+ *
+ * Returns the files, largest first
+ */
+static gen_file_t *make_corpus(const char *dir, size_t count, size_t bytes,
+                               double alpha) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create directory %s (%s)\n", dir,
+                strerror(errno));
+        exit(1);
+    }
+
+    double total;
+    double *weights = zipf_weights(count, alpha, &total);
+    gen_file_t *files = malloc(count * sizeof(gen_file_t));
+    if (files == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t k = 0; k < count; k++) {
+        size_t size = (size_t)llround(bytes * weights[k] / total);
+        files[k].size = size > 0 ? size : 1;
+        if (asprintf(&files[k].path, "%s/file%06zu.%s", dir, k + 1,
+                     binary ? "bin" : "txt") < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    free(weights);
+    return files;
+}
+
+/* Writes a trace of nreq requests to the count files of the corpus to
+ * dir/trace, whose popularity follows a Zipf distribution of exponent
+ * alpha. Which files are the most popular is independent of their size
+ *
+ * Returns whether it succeeded
+ */
+static bool make_trace(const char *dir, const gen_file_t *files,
+                       size_t count, size_t nreq, double alpha,
+                       const char *url) {
+    char *path;
+    if (asprintf(&path, "%s/trace", dir) < 0) {
+        return false;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not write trace %s (%s)\n", path,
+                strerror(errno));
+        free(path);
+        return false;
+    }
+
+    // cumulative weights, for sampling ranks by binary search
+    double total;
+    double *cdf = zipf_weights(count, alpha, &total);
+    for (size_t k = 1; k < count; k++) {
+        cdf[k] += cdf[k - 1];
+    }
+
+    // shuffle which file has which rank
+    size_t *order = malloc(count * sizeof(size_t));
+    if (order == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    uint64_t state = path_seed(path);
+    for (size_t k = 0; k < count; k++) {
+        order[k] = k;
+    }
+    for (size_t k = count - 1; k > 0; k--) {
+        size_t j = mix(state += GOLDEN) % (k + 1);
+        size_t tmp = order[k];
+        order[k] = order[j];
+        order[j] = tmp;
+    }
+
+    for (size_t i = 0; i < nreq; i++) {
+        double u = (mix(state += GOLDEN) >> 11) * 0x1p-53 * total;
+        size_t lo = 0, hi = count - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (cdf[mid] <= u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        const gen_file_t *file = &files[order[lo]];
+        const char *name = strrchr(file->path, '/') + 1;
+        fprintf(out, "%.3f %s%s %zu\n", (double)i / TRACE_RATE, url, name,
+                file->size);
+    }
+
+    free(order);
+    free(cdf);
+    bool ok = fclose(out) == 0;
+    free(path);
+    return ok;
+}
+
+/* Parses a number of bytes, with an optional K, M or G suffix (powers of
+ * 1000, as in pxydrive)
+ *
+ * Returns whether spec is one
+ */
+static bool parse_bytes(const char *spec, size_t *bytes) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(spec, &end, 10);
+    if (end == spec || errno != 0) {
+        return false;
+    }
+    for (; *end != '\0'; end++) {
+        switch (*end) {
+        case 'K':
+        case 'k':
+            value *= 1000;
+            break;
+        case 'M':
+        case 'm':
+            value *= 1000 * 1000;
+            break;
+        case 'G':
+        case 'g':
+            value *= 1000 * 1000 * 1000;
+            break;
+        default:
+            return false;
+        }
+    }
+    *bytes = value;
+    return true;
+}
+
+/* Returns the 16-bit threshold for a percentage */
+static uint32_t pct_limit(double pct) {
+    return pct <= 0 ? 0 : pct >= 100 ? 1 << 16 : (uint32_t)(pct * 655.36);
+}
+
+static void usage(char *name) {
+    printf("Usage: %s -p PATH -n BYTES [-b] [-z ZPCT] [-l LPCT] "
+           "[-c COUNT [-s SALPHA] [-r REQUESTS [-a PALPHA]] [-u URL]] "
+           "[-t THREADS]\n",
+           name);
+    printf("    -h          Print this information\n");
+    printf("    -z ZPCT     Percentage of null characters\n");
+    printf("    -l LPCT     Percentage of linefeed characters\n");
+    printf("    -p PATH     Output file (directory with -c)\n");
+    printf("    -n BYTES    File length (total length with -c)\n");
+    printf("    -b          Binary data\n");
+    printf("    -c COUNT    Generate a corpus of COUNT files\n");
+    printf("    -s SALPHA   Zipf exponent of file sizes (default 1.0)\n");
+    printf("    -r REQUESTS Write a trace of REQUESTS requests to "
+           "PATH/trace\n");
+    printf("    -a PALPHA   Zipf exponent of file popularity (default 0.8)\n");
+    printf("    -u URL      Prefix of the URLs of the trace "
+           "(default http://localhost/)\n");
+    printf("    -t THREADS  Number of threads (default: one per CPU)\n");
+    printf("    BYTES, COUNT and REQUESTS may have a K, M or G suffix\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    char *path = NULL;
+    size_t bytes = 0;
+    bool have_bytes = false;
+    double zero_pct = 5;
+    double lf_pct = 5;
+    size_t count = 0;
+    size_t nreq = 0;
+    double size_alpha = 1.0;
+    double pop_alpha = 0.8;
+    const char *url = "http://localhost/";
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int c;
+    while ((c = getopt(argc, argv, "hp:n:bz:l:c:s:r:a:u:t:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 'n':
+            if (!parse_bytes(optarg, &bytes)) {
+                usage(argv[0]);
+            }
+            have_bytes = true;
+            break;
+        case 'b':
+            binary = true;
+            break;
+        case 'z':
+            zero_pct = atof(optarg);
+            break;
+        case 'l':
+            lf_pct = atof(optarg);
+            break;
+        case 'c':
+            if (!parse_bytes(optarg, &count) || count == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            size_alpha = atof(optarg);
+            break;
+        case 'r':
+            if (!parse_bytes(optarg, &nreq)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            pop_alpha = atof(optarg);
+            break;
+        case 'u':
+            url = optarg;
+            break;
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (path == NULL) {
+        printf("Path argument required\n");
+        usage(argv[0]);
+    }
+    if (!have_bytes) {
+        printf("Length argument required\n");
+        usage(argv[0]);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+    zero_limit = pct_limit(zero_pct);
+    lf_limit = pct_limit(zero_pct + lf_pct);
+
+    bool ok;
+    if (count == 0) {
+        gen_file_t file = {.path = path, .size = bytes};
+        ok = generate(&file, 1, (int)nthreads);
+    } else {
+        gen_file_t *files = make_corpus(path, count, bytes, size_alpha);
+        ok = generate(files, count, (int)nthreads);
+        if (ok && nreq > 0) {
+            ok = make_trace(path, files, count, nreq, pop_alpha, url);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to generate file '%s'\n", path);
+        return 1;
+    }
+    return 0;
+}
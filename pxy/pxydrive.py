@@ -83,6 +83,8 @@ class Driver:
     haveProxy = False
     proxyProcess = None
     getId = 0
+    # Time (seconds relative to start of event manager) of last timer command
+    timerStart = 0.0
 
 
     # Mapping from id to event.  Used to implement wait *
@@ -114,6 +116,7 @@ class Driver:
         self.proxyProcess = None
         self.activeEvents = {}
         self.getId = 0
+        self.timerStart = 0.0
 
         self.console.addOption("strict", self.strict, "Set level of strictness on HTTP message formatting (0-4)")
         self.console.addOption("timing", self.checkTiming, "Insert random delays into synchronization operations")
@@ -133,6 +136,7 @@ class Driver:
         self.console.addCommand("get", self.doGet,            "URL", "Retrieve web object with and without proxy and compare the two")
         self.console.addCommand("delay", self.doDelay,         "MS",              "Delay for MS milliseconds")
         self.console.addCommand("check", self.doCheck,         "ID [CODE]",     "Make sure request ID handled properly and generated expected CODE")
+        self.console.addCommand("cache-control", self.doCacheControl, "SID VALUE", "Send Cache-Control header VALUE with responses from server SID (quote VALUE to keep spaces)")
         self.console.addCommand("generate", self.doGenerate,   "FILE BYTES",      "Generate file (extension '.txt' or '.bin') with specified number of bytes")
         self.console.addCommand("delete", self.doDelete,       "FILE+",  "Delete specified files")
         self.console.addCommand("proxy", self.doProxy,         "[PATH] ARG*", "(Re)start proxy server (pass arguments to proxy)")
@@ -141,6 +145,11 @@ class Driver:
         self.console.addCommand("signal", self.doSignal,       "[SIGNO]", "Send signal number SIGNO to process.  Default = 13 (SIGPIPE)")
         self.console.addCommand("disrupt", self.doDisrupt,     "(request|response) [SID]", "Schedule disruption of request or response by client [or server SID]")
         self.console.addCommand("wait", self.doWait,          "* | ID+", "Wait until all or listed pending requests, fetches, and responses have completed")
+        self.console.addCommand("timer", self.doTimer,         "",      "Start timing (for elapsed and throughput)")
+        self.console.addCommand("elapsed", self.doElapsed,     "MS",    "Make sure at most MS milliseconds have passed since timer")
+        self.console.addCommand("latency", self.doLatency,     "ID [MS]", "Report time taken by request ID and make sure it was at most MS milliseconds")
+        self.console.addCommand("faster", self.doFaster,       "FAST SLOW FACTOR", "Make sure requests FAST took at most 1/FACTOR the time of requests SLOW (comma-separated IDs are compared by fastest, only reported when stretch is above 100)")
+        self.console.addCommand("throughput", self.doThroughput, "[RPS]", "Report rate of requests completed since timer and make sure it was at least RPS per second")
 
 
     def run(self, commandList = []):
@@ -437,6 +446,139 @@ class Driver:
         self.console.outMsg("Request %s yielded expected status '%s'" % (rid, event.tag))
         return True
 
+    # Scale limit on time by stretch factor
+    def stretchTime(self, ms):
+        return ms * self.stretch.getInteger()/100.0
+
+    # Find latency of completed request rid (in ms), or None after printing error
+    def findLatency(self, rid):
+        event = self.eventManager.findEvent(True, rid)
+        if event is None:
+            self.console.errMsg("Invalid request ID '%s'" % rid)
+            return None
+        latency = event.latency()
+        if latency is None:
+            self.console.errMsg("Request %s has not completed" % rid)
+            return None
+        return latency * 1000.0
+
+    # Find shortest latency (in ms) of comma-separated list of requests.
+    # The fastest of several requests is the least disturbed by whatever
+    # else the machine happens to be doing
+    def bestLatency(self, ids):
+        best = None
+        for rid in ids.split(','):
+            latency = self.findLatency(rid)
+            if latency is None:
+                return None
+            if best is None or latency < best:
+                best = latency
+        return best
+
+    def doTimer(self, args):
+        if len(args) != 0:
+            self.console.errMsg("Timer command takes no arguments")
+            return False
+        self.timerStart = self.eventManager.now()
+        return True
+
+    def doElapsed(self, args):
+        if len(args) != 1:
+            self.console.errMsg("Elapsed command takes one argument")
+            return False
+        try:
+            limit = self.stretchTime(float(args[0]))
+        except:
+            self.console.errMsg("Invalid time limit '%s'" % args[0])
+            return False
+        ms = (self.eventManager.now() - self.timerStart) * 1000.0
+        if ms > limit:
+            self.console.errMsg("%.1f ms elapsed since timer.  Expecting at most %.1f ms" % (ms, limit))
+            return False
+        self.console.outMsg("%.1f ms elapsed since timer" % ms)
+        return True
+
+    def doLatency(self, args):
+        if len(args) == 0 or len(args) > 2:
+            self.console.errMsg("Latency command requires 1-2 arguments")
+            return False
+        limit = None
+        if len(args) > 1:
+            try:
+                limit = self.stretchTime(float(args[1]))
+            except:
+                self.console.errMsg("Invalid time limit '%s'" % args[1])
+                return False
+        rid = args[0]
+        latency = self.findLatency(rid)
+        if latency is None:
+            return False
+        if limit is not None and latency > limit:
+            self.console.errMsg("Request %s took %.1f ms.  Expecting at most %.1f ms" % (rid, latency, limit))
+            return False
+        self.console.outMsg("Request %s took %.1f ms" % (rid, latency))
+        return True
+
+    def doFaster(self, args):
+        if len(args) != 3:
+            self.console.errMsg("Faster command requires three arguments")
+            return False
+        try:
+            factor = float(args[2])
+        except:
+            self.console.errMsg("Invalid factor '%s'" % args[2])
+            return False
+        fast = self.bestLatency(args[0])
+        slow = self.bestLatency(args[1])
+        if fast is None or slow is None:
+            return False
+        # A fixed ratio does not hold up on slow or loaded runs, such as under
+        # valgrind, so with stretch above 100 the speedup is only reported
+        if fast * factor > slow and self.stretch.getInteger() > 100:
+            self.console.outMsg("Requests %s took %.1f ms and requests %s took %.1f ms (%.1fx speedup, %.1fx not checked with stretch %d)" %
+                                (args[0], fast, args[1], slow, slow / max(fast, 1e-3), factor, self.stretch.getInteger()))
+            return True
+        if fast * factor > slow:
+            self.console.errMsg("Requests %s took %.1f ms and requests %s took %.1f ms.  Expecting %.1fx speedup, got %.1fx" %
+                                (args[0], fast, args[1], slow, factor, slow / max(fast, 1e-3)))
+            return False
+        self.console.outMsg("Requests %s took %.1f ms and requests %s took %.1f ms (%.1fx speedup)" %
+                            (args[0], fast, args[1], slow, slow / max(fast, 1e-3)))
+        return True
+
+    def doThroughput(self, args):
+        if len(args) > 1:
+            self.console.errMsg("Throughput command takes at most one argument")
+            return False
+        limit = None
+        if len(args) == 1:
+            try:
+                limit = float(args[0]) * 100.0 / self.stretch.getInteger()
+            except:
+                self.console.errMsg("Invalid rate '%s'" % args[0])
+                return False
+        count = 0
+        bytes = 0
+        latencies = []
+        for event in self.eventManager.requestEvents():
+            if event.latency() is None or event.startTime < self.timerStart:
+                continue
+            count += 1
+            bytes += event.bytes
+            latencies.append(event.latency() * 1000.0)
+        secs = self.eventManager.now() - self.timerStart
+        if count == 0 or secs <= 0:
+            self.console.errMsg("No requests completed since timer")
+            return False
+        latencies.sort()
+        rate = count / secs
+        self.console.outMsg("%d requests in %.2f s: %.1f requests/s, %.1f KB/s.  Latency median %.1f ms, max %.1f ms" %
+                            (count, secs, rate, bytes / secs / 1000.0, latencies[count/2], latencies[-1]))
+        if limit is not None and rate < limit:
+            self.console.errMsg("Expecting at least %.1f requests/s" % limit)
+            return False
+        return True
+
     def doGenerate(self, args):
         if len(args) != 2:
             self.console.errMsg("Generate command requires two arguments")
@@ -460,6 +602,17 @@ class Driver:
             self.console.outMsg("Generated file '%s'" % path)
         return True
         
+    def doCacheControl(self, args):
+        if len(args) < 2:
+            self.console.errMsg("Cache-control command requires two arguments")
+            return False
+        sid = args[0]
+        if sid not in self.servers:
+            self.console.errMsg("Invalid server ID '%s'" % sid)
+            return False
+        self.servers[sid].cacheControl = self.console.makeFileName(args[1:])
+        return True
+
     def doDelete(self, args):
         ok = True
         for fname in args:
@@ -0,0 +1,303 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the name lookups used by proxy.c
+ *
+ * Queued lookups are handed out to the resolver threads in order. The
+ * answers in the cache belong to it, and every lookup gets a copy of its
+ * own, so an answer can be replaced while requests still use the old one.
+ * The cache is a direct mapped table, a host and port simply replacing
+ * whatever answer was in its slot.
+ *
+ * getaddrinfo cannot be interrupted, so a lookup that is abandoned while
+ * underway is only marked as such, and freed by the thread running it once
+ * it returns. Cancelling one only wakes its caller up early: the thread
+ * running it still has to finish before it can be freed.
+ *
+ * See resolver.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "resolver.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Type for the state of a lookup
+ *
+ * lookup is the public part, and must come first
+ * key is "host:port", the key of its answer in the cache
+ * done, abandoned and lookup.cancelled are protected by queue_lock, done
+ * meaning no resolver thread uses the query any more
+ * next links it into the queue
+ */
+typedef struct query {
+    lookup_t lookup;
+    char *key;
+    char *host;
+    char *port;
+    bool done;
+    bool abandoned;
+    struct query *next;
+} query_t;
+
+/* Type for a cached answer, key is NULL in an empty slot */
+typedef struct {
+    char *key;
+    struct addrinfo *addrs;
+    uint64_t expires;
+} answer_t;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static query_t *queue_head = NULL;
+static query_t *queue_tail = NULL;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static answer_t answers[RESOLVER_CACHE_SLOTS];
+
+/* Returns the current monotonic time in milliseconds */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns the slot of the cache for key, using FNV-1a */
+static answer_t *slot_of(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = key; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return &answers[hash % RESOLVER_CACHE_SLOTS];
+}
+
+/* Returns a copy of addrs, to be freed with free_addrs */
+static struct addrinfo *copy_addrs(const struct addrinfo *addrs) {
+    struct addrinfo *copy = NULL;
+    struct addrinfo **tail = &copy;
+    for (const struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+        // every address lives right behind its addrinfo
+        struct addrinfo *node =
+            Malloc(sizeof(struct addrinfo) + ai->ai_addrlen);
+        *node = *ai;
+        node->ai_addr = (struct sockaddr *)(node + 1);
+        memcpy(node->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        node->ai_canonname = NULL;
+        node->ai_next = NULL;
+        *tail = node;
+        tail = &node->ai_next;
+    }
+    return copy;
+}
+
+/* Frees addresses returned by copy_addrs */
+static void free_addrs(struct addrinfo *addrs) {
+    while (addrs != NULL) {
+        struct addrinfo *next = addrs->ai_next;
+        free(addrs);
+        addrs = next;
+    }
+}
+
+/* Returns a copy of the cached answer for key, or NULL if there is none */
+static struct addrinfo *cache_get(const char *key) {
+    struct addrinfo *addrs = NULL;
+    answer_t *answer = slot_of(key);
+    pthread_mutex_lock(&cache_lock);
+    if (answer->key != NULL && strcmp(answer->key, key) == 0 &&
+        answer->expires > now_ms()) {
+        addrs = copy_addrs(answer->addrs);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return addrs;
+}
+
+/* Caches addrs, from getaddrinfo, as the answer for key */
+static void cache_put(const char *key, struct addrinfo *addrs) {
+    answer_t *answer = slot_of(key);
+    pthread_mutex_lock(&cache_lock);
+    if (answer->key != NULL) {
+        free(answer->key);
+        freeaddrinfo(answer->addrs);
+    }
+    answer->key = strdup(key);
+    answer->addrs = addrs;
+    answer->expires = now_ms() + RESOLVER_TTL_MS;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Frees a query along with its addresses */
+static void free_query(query_t *q) {
+    free_addrs(q->lookup.addrs);
+    free(q->key);
+    free(q->host);
+    free(q->port);
+    free(q);
+}
+
+/* Thread routine of the resolver threads, running queued lookups */
+static void *resolve(void *vargp) {
+    (void)vargp;
+    while (true) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        query_t *q = queue_head;
+        if ((queue_head = q->next) == NULL) {
+            queue_tail = NULL;
+        }
+        bool skip = q->abandoned || q->lookup.cancelled;
+        pthread_mutex_unlock(&queue_lock);
+
+        struct addrinfo *addrs = NULL;
+        struct addrinfo *copy = NULL;
+        int error = 0;
+        if (!skip) {
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(struct addrinfo));
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+            if ((error = getaddrinfo(q->host, q->port, &hints, &addrs)) ==
+                0) {
+                copy = copy_addrs(addrs);
+                cache_put(q->key, addrs);
+            }
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        if (q->abandoned) {
+            pthread_mutex_unlock(&queue_lock);
+            free_addrs(copy);
+            free_query(q);
+            continue;
+        }
+        q->done = true;
+        if (q->lookup.cancelled) {
+            // its caller has been woken up already
+            pthread_mutex_unlock(&queue_lock);
+            free_addrs(copy);
+            continue;
+        }
+        q->lookup.addrs = copy;
+        q->lookup.error = error;
+        uint64_t one = 1;
+        if (write(q->lookup.fd, &one, sizeof(one)) < 0) {
+            perror("resolver write");
+        }
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
+
+/* Starts the resolver threads */
+int resolver_init(void) {
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, resolve, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/* Starts looking up host and port, see resolver.h */
+lookup_t *resolver_lookup(const char *host, const char *port) {
+    query_t *q = Calloc(1, sizeof(query_t));
+    q->lookup.fd = -1;
+    q->key = Malloc(strlen(host) + strlen(port) + 2);
+    sprintf(q->key, "%s:%s", host, port);
+
+    if ((q->lookup.addrs = cache_get(q->key)) != NULL) {
+        q->done = true;
+        return &q->lookup;
+    }
+
+    if ((q->lookup.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        q->lookup.error = EAI_SYSTEM;
+        q->done = true;
+        return &q->lookup;
+    }
+
+    q->host = strdup(host);
+    q->port = strdup(port);
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail != NULL) {
+        queue_tail->next = q;
+    } else {
+        queue_head = q;
+    }
+    queue_tail = q;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return &q->lookup;
+}
+
+/* Makes progress on a lookup, see resolver.h */
+int resolver_poll(lookup_t *lookup) {
+    query_t *q = (query_t *)lookup;
+    if (lookup->fd < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    bool done = q->done || lookup->cancelled;
+    pthread_mutex_unlock(&queue_lock);
+    if (!done) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+/* Cancels a lookup that is still underway, see resolver.h */
+bool resolver_cancel(lookup_t *lookup) {
+    query_t *q = (query_t *)lookup;
+    bool cancelled = false;
+    pthread_mutex_lock(&queue_lock);
+    if (lookup->fd >= 0 && !q->done && !lookup->cancelled) {
+        lookup->cancelled = true;
+        lookup->error = EAI_AGAIN;
+        uint64_t one = 1;
+        if (write(lookup->fd, &one, sizeof(one)) < 0) {
+            perror("resolver write");
+        }
+        cancelled = true;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return cancelled;
+}
+
+/* Frees lookup, abandoning it if it is still underway */
+void resolver_free(lookup_t *lookup) {
+    if (lookup == NULL) {
+        return;
+    }
+
+    query_t *q = (query_t *)lookup;
+    if (lookup->fd >= 0) {
+        pthread_mutex_lock(&queue_lock);
+        close(lookup->fd);
+        lookup->fd = -1;
+        if (!q->done) {
+            // the thread running it frees it
+            q->abandoned = true;
+            pthread_mutex_unlock(&queue_lock);
+            return;
+        }
+        pthread_mutex_unlock(&queue_lock);
+    }
+    free_query(q);
+}
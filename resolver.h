@@ -0,0 +1,82 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for resolver.c
+ *
+ * These files implement the name lookups proxy.c needs before connecting to
+ * a server. getaddrinfo blocks, for as long as the DNS servers take to
+ * answer, so it never runs on an event loop:
+ *  - answers are cached per host and port for RESOLVER_TTL_MS, and a lookup
+ *    that finds its answer there is done as soon as it is started
+ *  - other lookups are queued for a pool of RESOLVER_THREADS threads, which
+ *    call getaddrinfo and wake the waiting task through an eventfd
+ *  - failed lookups are not cached, the proxy remembers unreachable hosts
+ *    itself
+ *
+ * A lookup is driven like a connector (see connector.h): resolver_poll fails
+ * with EAGAIN until the answer is in, and the caller waits for fd to become
+ * readable in between. A lookup that takes too long can be cancelled from
+ * another thread, which wakes the caller up right away.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netdb.h>
+#include <stdbool.h>
+
+// threads calling getaddrinfo
+#define RESOLVER_THREADS 4
+
+// time an answer is reused for, in milliseconds
+#define RESOLVER_TTL_MS 30000
+
+// slots of the cache of answers, each holding one host and port
+#define RESOLVER_CACHE_SLOTS 256
+
+/* Type for a lookup
+ *
+ * fd is the descriptor to wait on for readability while the lookup is
+ * underway, or -1 if it never needs to be waited for
+ * addrs holds the addresses found once the lookup is done, or NULL
+ * error is the getaddrinfo error of a lookup that failed, or 0
+ * cancelled is whether it was cancelled with resolver_cancel, in which case
+ * error is EAI_AGAIN
+ */
+typedef struct lookup {
+    int fd;
+    struct addrinfo *addrs;
+    int error;
+    bool cancelled;
+} lookup_t;
+
+/* Starts the resolver threads. Must be called before any lookup
+ *
+ * Returns 0 on success, or -1 if a thread could not be created
+ */
+int resolver_init(void);
+
+/* Starts looking up the stream sockets of host and port, a numeric port */
+lookup_t *resolver_lookup(const char *host, const char *port);
+
+/* Makes progress on a lookup
+ *
+ * Returns 0 once it is done, with addrs and error filled in. Fails with
+ * EAGAIN while it is underway, in which case the caller should wait until
+ * fd is readable and call it again
+ */
+int resolver_poll(lookup_t *lookup);
+
+/* Cancels a lookup that is still underway, which makes it done without any
+ * addresses. Can be called from any thread, as long as lookup is not freed
+ * meanwhile
+ *
+ * Returns true if the lookup was cancelled, or false if it was already done
+ */
+bool resolver_cancel(lookup_t *lookup);
+
+/* Frees lookup and its addresses. A lookup that is still underway is
+ * abandoned
+ */
+void resolver_free(lookup_t *lookup);
+
+#endif /* RESOLVER_H */
@@ -0,0 +1,149 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the socket tuning used by proxy.c
+ *
+ * Options that affect accepted connections (TCP_NODELAY and the buffer
+ * sizes) are set on the listening socket, since Linux copies them into every
+ * socket accepted from it. That saves a few syscalls on every connection.
+ *
+ * See sockopt.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "sockopt.h"
+#include "csapp.h"
+#include "options.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+sockopt_t sockopts = {
+    .nodelay = true,
+    .defer_accept = 5,
+    .fastopen = 256,
+    .fastopen_connect = false,
+    .sndbuf = 0,
+    .rcvbuf = 0,
+};
+
+static const option_t options[] = {
+    {"nodelay", true, &sockopts.nodelay, "TCP_NODELAY on all sockets"},
+    {"defer_accept", false, &sockopts.defer_accept,
+     "TCP_DEFER_ACCEPT timeout in seconds"},
+    {"fastopen", false, &sockopts.fastopen,
+     "TCP Fast Open queue length of the listener"},
+    {"fastopen_connect", true, &sockopts.fastopen_connect,
+     "TCP Fast Open to servers with one address"},
+    {"sndbuf", false, &sockopts.sndbuf, "SO_SNDBUF in bytes"},
+    {"rcvbuf", false, &sockopts.rcvbuf, "SO_RCVBUF in bytes"},
+};
+
+/* Sets the option described by spec, of the form "name=value" */
+int sockopt_parse(const char *spec) {
+    return options_parse(options, NUM_OPTIONS(options), spec, INT_MAX);
+}
+
+/* Prints the names and meaning of all options to stdout */
+void sockopt_usage(void) {
+    options_usage(options, NUM_OPTIONS(options));
+}
+
+/* Sets an integer socket option, warning if the kernel refuses it */
+static void set_opt(int fd, int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "setsockopt %s: %s\n", what, strerror(errno));
+    }
+}
+
+/* Applies the options shared by listening and server sockets to fd */
+static void tune_common(int fd) {
+    if (sockopts.nodelay) {
+        set_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (sockopts.sndbuf > 0) {
+        set_opt(fd, SOL_SOCKET, SO_SNDBUF, sockopts.sndbuf, "SO_SNDBUF");
+    }
+    if (sockopts.rcvbuf > 0) {
+        set_opt(fd, SOL_SOCKET, SO_RCVBUF, sockopts.rcvbuf, "SO_RCVBUF");
+    }
+}
+
+/* Opens a tuned listening socket on port. This is adapted from
+ * open_listenfd in csapp.c
+ */
+int sockopt_listen(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc;
+
+    /* Get a list of potential server addresses */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -1;
+    }
+
+    /* Walk the list for one that we can bind to */
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+
+        set_opt(listenfd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+
+    // buffer sizes must be set before listen to affect the TCP window
+    tune_common(listenfd);
+    if (sockopts.defer_accept > 0) {
+        set_opt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                sockopts.defer_accept, "TCP_DEFER_ACCEPT");
+    }
+
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    // Fast Open is also turned off system wide by net.ipv4.tcp_fastopen,
+    // so failing here is not worth a warning
+    if (sockopts.fastopen > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &sockopts.fastopen,
+                   sizeof(sockopts.fastopen));
+    }
+    return listenfd;
+}
+
+/* Creates a tuned non-blocking socket for connecting to a server */
+int sockopt_socket(int family, int type, int protocol, bool fastopen) {
+    int fd = socket(family, type | SOCK_NONBLOCK, protocol);
+    if (fd < 0) {
+        return -1;
+    }
+
+    tune_common(fd);
+    if (sockopts.fastopen_connect && fastopen) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+    }
+    return fd;
+}
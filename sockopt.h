@@ -0,0 +1,74 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for sockopt.c
+ *
+ * These files implement the socket tuning used by proxy.c. open_listenfd in
+ * csapp.c only sets SO_REUSEADDR, so the proxy opens its listening socket and
+ * its upstream sockets through here instead, which applies:
+ *  - TCP_DEFER_ACCEPT on the listener, so a connection is only accepted once
+ *    its request bytes have arrived, and an idle one never wakes a loop up
+ *  - TCP_FASTOPEN on the listener, and optionally TCP_FASTOPEN_CONNECT on
+ *    upstream sockets, so a request can ride along with the SYN
+ *  - TCP_NODELAY on both sides, so request and response headers, which are
+ *    small writes, go out immediately instead of waiting on Nagle
+ *  - SO_SNDBUF/SO_RCVBUF, when set. By default the kernel sizes the buffers
+ *
+ * Every option can be changed with sockopt_parse, from the proxy's -s flag.
+ */
+
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/* Type for the socket options in use
+ *
+ * nodelay sets TCP_NODELAY on client and server sockets
+ * defer_accept is the TCP_DEFER_ACCEPT timeout in seconds, 0 to disable it
+ * fastopen is the TCP Fast Open queue length of the listener, 0 to disable it
+ * fastopen_connect uses TCP Fast Open for connections to servers that have
+ * a single address
+ * sndbuf and rcvbuf are socket buffer sizes in bytes, 0 to leave them alone
+ */
+typedef struct {
+    bool nodelay;
+    int defer_accept;
+    int fastopen;
+    bool fastopen_connect;
+    int sndbuf;
+    int rcvbuf;
+} sockopt_t;
+
+/* The options in use, which start out as the defaults */
+extern sockopt_t sockopts;
+
+/* Sets the option described by spec, of the form "name=value"
+ *
+ * Returns 0 on success, or -1 if spec does not name a known option
+ */
+int sockopt_parse(const char *spec);
+
+/* Prints the names and meaning of all options to stdout */
+void sockopt_usage(void);
+
+/* Opens a tuned listening socket on port. Sockets accepted from it inherit
+ * its options
+ *
+ * Returns the descriptor, or -1 on error
+ */
+int sockopt_listen(const char *port);
+
+/* Creates a tuned non-blocking socket for connecting to a server at an
+ * address of the given family, type and protocol
+ *
+ * With fastopen_connect and fastopen, connect on it returns 0 right away,
+ * and the handshake only starts with the first write, which fails with
+ * EINPROGRESS until it completes. Callers that need to know whether the
+ * connect succeeded, such as a race between addresses, pass false
+ *
+ * Returns the descriptor, or -1 on error
+ */
+int sockopt_socket(int family, int type, int protocol, bool fastopen);
+
+#endif /* SOCKOPT_H */
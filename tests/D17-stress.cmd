@@ -19,6 +19,7 @@ generate random-binary11.bin  66K
 generate random-binary12.bin  50K
 generate random-binary13.bin  33K
 generate random-binary14.bin  20K
+timer
 # Move data
 fetch fc00a random-binary00.bin s0
 fetch fc01a random-binary01.bin s1
@@ -134,6 +135,9 @@ fetch fs07d random-binary07.bin s10
 fetch fs08d random-binary08.bin s10
 fetch fs09d random-binary09.bin s10
 wait *
+# All traffic must be handled within 10 seconds
+elapsed 10000
+throughput
 check fc00a
 check fc01a
 check fc02a
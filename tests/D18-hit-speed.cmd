@@ -0,0 +1,57 @@
+# Make sure cache hits are served faster than misses
+# This test can be passed by a sequential proxy
+serve s1
+generate random-binary1.bin 90K
+generate random-binary2.bin 90K
+generate random-binary3.bin 90K
+generate random-binary4.bin 90K
+generate random-binary5.bin 90K
+generate random-binary6.bin 90K
+generate random-binary7.bin 90K
+# Alternate misses with hits on files fetched earlier
+fetch m1 random-binary1.bin s1
+wait *
+fetch m2 random-binary2.bin s1
+wait *
+fetch h1 random-binary1.bin s1
+wait *
+fetch m3 random-binary3.bin s1
+wait *
+fetch h2 random-binary2.bin s1
+wait *
+fetch m4 random-binary4.bin s1
+wait *
+fetch h3 random-binary3.bin s1
+wait *
+fetch m5 random-binary5.bin s1
+wait *
+fetch h4 random-binary4.bin s1
+wait *
+fetch m6 random-binary6.bin s1
+wait *
+fetch h5 random-binary5.bin s1
+wait *
+fetch m7 random-binary7.bin s1
+wait *
+fetch h6 random-binary6.bin s1
+wait *
+fetch h7 random-binary7.bin s1
+wait *
+check m1
+check m2
+check m3
+check m4
+check m5
+check m6
+check m7
+check h1
+check h2
+check h3
+check h4
+check h5
+check h6
+check h7
+# Fastest hit must be at least 1.5 times faster than fastest miss.
+# On runs stretched beyond 100 the ratio is only reported
+faster h1,h2,h3,h4,h5,h6,h7 m1,m2,m3,m4,m5,m6,m7 1.5
+quit
@@ -0,0 +1,15 @@
+# Make sure responses the server marks no-store are not cached, even with
+# whitespace after the directive
+# This test can be passed by a sequential proxy
+serve s1
+cache-control s1 "no-store "
+generate random-text1.txt 10K
+fetch f1 random-text1.txt s1
+wait *
+check f1
+# Served from the cache, this would still succeed
+delete random-text1.txt
+fetch f2 random-text1.txt s1
+wait *
+check f2 404
+quit
@@ -0,0 +1,40 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the options for the deadlines of proxy.c
+ *
+ * See timeout.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "timeout.h"
+#include "options.h"
+
+#include <limits.h>
+
+timeout_opts_t timeout_opts = {
+    .header = 10,
+    .idle = 60,
+    .connect = 10,
+    .total = 3600,
+};
+
+static const option_t options[] = {
+    {"header", false, &timeout_opts.header, "Seconds to read the request in"},
+    {"idle", false, &timeout_opts.idle, "Seconds without any progress"},
+    {"connect", false, &timeout_opts.connect,
+     "Seconds to connect to the server"},
+    {"total", false, &timeout_opts.total,
+     "Seconds to serve the whole request"},
+};
+
+/* Sets the option described by spec, of the form "name=value" */
+int timeout_parse(const char *spec) {
+    // deadlines are turned into milliseconds, which have to fit an int
+    return options_parse(options, NUM_OPTIONS(options), spec, INT_MAX / 1000);
+}
+
+/* Prints the names and meaning of all options to stdout */
+void timeout_usage(void) {
+    options_usage(options, NUM_OPTIONS(options));
+}
@@ -0,0 +1,43 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for timeout.c
+ *
+ * These files hold the deadlines proxy.c enforces on every connection, so a
+ * client or server that stops making progress cannot hold on to a
+ * connection, its descriptors and its admission forever:
+ *  - header, from accept until the whole request has been read. It does not
+ *    move when a line arrives, so a slowloris client that trickles its
+ *    headers in one byte at a time is cut off just like a silent one
+ *  - idle, the longest time without a single byte read or written
+ *  - connect, the longest time spent connecting to the server
+ *  - total, from accept until the response has been fully relayed
+ *
+ * The deadlines are checked by the timer wheels of the event loops (see
+ * loop.h) and by the io_uring relay loops (see uring.h). Every option can be
+ * changed with timeout_parse, from the proxy's -t flag.
+ */
+
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+/* Type for the deadlines in use, all in seconds and 0 for no limit */
+typedef struct {
+    int header;
+    int idle;
+    int connect;
+    int total;
+} timeout_opts_t;
+
+/* The deadlines in use, which start out as the defaults */
+extern timeout_opts_t timeout_opts;
+
+/* Sets the option described by spec, of the form "name=value"
+ *
+ * Returns 0 on success, or -1 if spec does not name a known option
+ */
+int timeout_parse(const char *spec);
+
+/* Prints the names and meaning of all options to stdout */
+void timeout_usage(void);
+
+#endif /* TIMEOUT_H */
@@ -1,5 +1,8 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * When started by Tiny as a persistent worker (TINY_CGI_WORKER is set, see
+ * tiny.c), it answers one query string per line of stdin instead of once.
  */
 /* $begin adder */
 #include "csapp.h"
@@ -8,13 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 
-int main(void) {
-    char *buf, *p;
+/*
+ * respond - build the CGI output for the query string buf into out, which
+ * holds size bytes. Returns its length.
+ */
+size_t respond(char *buf, char *out, size_t size) {
+    char *p;
     char content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (buf != NULL) {
         p = strchr(buf, '&');
         if (p != NULL) {
             *p = '\0';
@@ -32,13 +39,37 @@ int main(void) {
         n1, n2, n1 + n2);
 
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %zu\r\n", strlen(content));
-    printf("Content-type: text/html\r\n");
-    printf("\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    return snprintf(out, size,
+        "Connection: close\r\n"
+        "Content-length: %zu\r\n"
+        "Content-type: text/html\r\n"
+        "\r\n"
+        "%s",
+        strlen(content), content);
+}
 
+int main(void) {
+    char out[MAXBUF];
+    size_t len;
+
+    if (getenv("TINY_CGI_WORKER") == NULL) {
+        len = respond(getenv("QUERY_STRING"), out, sizeof(out));
+        fwrite(out, 1, len, stdout);
+        fflush(stdout);
+        exit(0);
+    }
+
+    /* Persistent worker: one query string per line */
+    char query[MAXLINE];
+    printf("TINY-CGI/1\n");
+    fflush(stdout);
+    while (fgets(query, sizeof(query), stdin) != NULL) {
+        query[strcspn(query, "\n")] = '\0';
+        len = respond(query, out, sizeof(out));
+        printf("%zu\n", len);
+        fwrite(out, 1, len, stdout);
+        fflush(stdout);
+    }
     exit(0);
 }
 /* $end adder */
@@ -2,6 +2,14 @@
  * tiny-static.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve the same static content regardless of the request.
  *
+ * With -m <docroot>, it instead loads every file under docroot into memory
+ * at startup, along with its complete response headers, and serves each
+ * request for one of them as a single writev() of headers and body, with
+ * no file system access at all. With -z as well, a gzip variant is kept of
+ * every file it makes smaller, and sent to clients that accept gzip. Since
+ * -m is meant for benchmarks, it does not log every request unless -v is
+ * given too.
+ *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
@@ -13,9 +21,15 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <fcntl.h>
+#include <ftw.h>
+#include <strings.h>
+#include <zlib.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -25,6 +39,9 @@
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/* Buckets of the hash table of files loaded into memory */
+#define ASSET_BUCKETS 1024
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
@@ -37,6 +54,28 @@ typedef struct {
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* One encoding of a file loaded into memory: its response headers and
+ * body, ready to be sent with writev(). */
+typedef struct {
+    char *headers;
+    size_t headers_len;
+    char *body;
+    size_t body_len;
+} variant;
+
+/* A file loaded into memory. */
+typedef struct asset {
+    char *path;                 // Path as produced by parse_uri, "./..."
+    variant plain;              // The file as is
+    variant gzip;               // The file gzipped, or with no body if none
+    struct asset *next;         // Next asset in the same hash bucket
+} asset;
+
+static asset *assets[ASSET_BUCKETS];
+static bool in_memory = false;
+static bool use_gzip = false;
+static bool verbose = false;
+
 /* URI parsing results. */
 typedef enum {
     PARSE_ERROR,
@@ -46,17 +85,25 @@ typedef enum {
 
 /*
  * read_requesthdrs - read HTTP request headers
+ * Sets *gzip if the client accepts gzip encoded responses.
  * Returns true if an error occurred, or false otherwise.
  */
-bool read_requesthdrs(rio_t *rp) {
+bool read_requesthdrs(rio_t *rp, bool *gzip) {
     char buf[MAXLINE];
 
+    *gzip = false;
     do {
         if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
             return true;
         }
 
-        printf("%s", buf);
+        if (verbose) {
+            printf("%s", buf);
+        }
+        if (strncasecmp(buf, "Accept-Encoding:", 16) == 0
+                && strstr(buf, "gzip") != NULL) {
+            *gzip = true;
+        }
     } while(strncmp(buf, "\r\n", sizeof("\r\n")));
 
     return false;
@@ -193,6 +240,182 @@ void serve_static(int fd, char *filename, int filesize) {
     }
 }
 
+/*
+ * asset_hash - hash a path into a bucket of the table of assets
+ */
+size_t asset_hash(const char *path) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    }
+    return hash % ASSET_BUCKETS;
+}
+
+/*
+ * make_variant - fill in v with the headers for a body of len bytes of
+ * the file filename, encoded with encoding if it is not NULL
+ */
+void make_variant(variant *v, char *filename, char *body, size_t len,
+                  const char *encoding) {
+    char filetype[MAXLINE];
+    char buf[MAXBUF];
+
+    get_filetype(filename, filetype);
+    int n = snprintf(buf, MAXBUF,
+            "HTTP/1.0 200 OK\r\n" \
+            "Server: Tiny Web Server\r\n" \
+            "Connection: close\r\n" \
+            "Content-Length: %zu\r\n" \
+            "Content-Type: %s\r\n" \
+            "%s%s%s" \
+            "%s\r\n", \
+            len, filetype,
+            encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+            encoding ? "\r\n" : "",
+            use_gzip ? "Vary: Accept-Encoding\r\n" : "");
+    v->headers = Malloc(n);
+    memcpy(v->headers, buf, n);
+    v->headers_len = n;
+    v->body = body;
+    v->body_len = len;
+}
+
+/*
+ * gzip_body - compress the len bytes at body in gzip format
+ * Returns the compressed bytes and stores their length in *outlen, or
+ * returns NULL if that would not make them smaller.
+ */
+char *gzip_body(char *body, size_t len, size_t *outlen) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    /* 15 window bits, plus 16 for a gzip rather than a zlib wrapper */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t cap = deflateBound(&zs, len);
+    char *out = Malloc(cap);
+    zs.next_in = (Bytef *) body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = cap;
+    int res = deflate(&zs, Z_FINISH);
+    *outlen = zs.total_out;
+    deflateEnd(&zs);
+
+    if (res != Z_STREAM_END || *outlen >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * load_asset - load one file into memory, called by nftw for every entry
+ * of the document root
+ */
+int load_asset(const char *path, const struct stat *sbuf, int type,
+               struct FTW *ftw) {
+    (void) ftw;
+    if (type != FTW_F || !S_ISREG(sbuf->st_mode)) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    size_t len = sbuf->st_size;
+    char *body = Malloc(len > 0 ? len : 1);
+    if (rio_readn(fd, body, len) != (ssize_t) len) {
+        fprintf(stderr, "Error reading \"%s\"\n", path);
+        free(body);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    asset *a = Calloc(1, sizeof(asset));
+    a->path = strdup(path);
+    make_variant(&a->plain, a->path, body, len, NULL);
+
+    size_t zlen;
+    char *zbody = use_gzip ? gzip_body(body, len, &zlen) : NULL;
+    if (zbody != NULL) {
+        make_variant(&a->gzip, a->path, zbody, zlen, "gzip");
+    }
+
+    size_t bucket = asset_hash(a->path);
+    a->next = assets[bucket];
+    assets[bucket] = a;
+    return 0;
+}
+
+/*
+ * load_docroot - load every file under docroot into memory, and make it
+ * the working directory
+ */
+void load_docroot(char *docroot) {
+    if (chdir(docroot) < 0) {
+        perror(docroot);
+        exit(1);
+    }
+    if (nftw(".", load_asset, 16, FTW_PHYS) < 0) {
+        perror("nftw");
+        exit(1);
+    }
+}
+
+/*
+ * find_asset - find the file at filename among those loaded into memory
+ * Returns NULL if there is none.
+ */
+asset *find_asset(const char *filename) {
+    asset *a = assets[asset_hash(filename)];
+    while (a != NULL && strcmp(a->path, filename) != 0) {
+        a = a->next;
+    }
+    return a;
+}
+
+/*
+ * serve_asset - send a file loaded into memory to the client, with a
+ * single writev() unless the socket takes only part of it
+ */
+void serve_asset(int fd, variant *v) {
+    struct iovec iov[2] = {
+        { v->headers, v->headers_len },
+        { v->body, v->body_len },
+    };
+    struct iovec *cur = iov;
+    int iovcnt = 2;
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, cur, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error writing static response to client\n");
+            return;
+        }
+
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char *) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+}
+
 /*
  * clienterror - returns an error message to the client
  */
@@ -246,17 +469,22 @@ void clienterror(int fd, char *cause, char *errnum,
  */
 void serve(client_info *client) {
     // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    int res = getnameinfo(
-            (SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
-    }
-    else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+    // This is optional, but it's nice to know who's connected. With -m the
+    // address is not looked up in DNS, which could take longer than the
+    // request
+    if (verbose) {
+        int res = getnameinfo(
+                (SA *) &client->addr, client->addrlen,
+                client->host, sizeof(client->host),
+                client->serv, sizeof(client->serv),
+                in_memory ? NI_NUMERICHOST | NI_NUMERICSERV : 0);
+        if (res == 0) {
+            printf("Accepted connection from %s:%s\n",
+                    client->host, client->serv);
+        }
+        else {
+            fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+        }
     }
 
     rio_t rio;
@@ -268,7 +496,9 @@ void serve(client_info *client) {
         return;
     }
 
-    printf("%s", buf);
+    if (verbose) {
+        printf("%s", buf);
+    }
 
     /* Parse the request line and check if it's well-formed */
     char method[MAXLINE];
@@ -292,7 +522,8 @@ void serve(client_info *client) {
     }
 
     /* Check if reading request headers caused an error */
-    if (read_requesthdrs(&rio)) {
+    bool gzip;
+    if (read_requesthdrs(&rio, &gzip)) {
         return;
     }
 
@@ -305,6 +536,18 @@ void serve(client_info *client) {
         return;
     }
 
+    /* Serve the requested file from memory */
+    if (in_memory) {
+        asset *a = result == PARSE_STATIC ? find_asset(filename) : NULL;
+        if (a == NULL) {
+            clienterror(client->connfd, filename, "404", "Not found",
+                    "Tiny couldn't find this file");
+            return;
+        }
+        serve_asset(client->connfd,
+                gzip && a->gzip.body != NULL ? &a->gzip : &a->plain);
+        return;
+    }
 
     /* Attempt to stat the file */
     struct stat sbuf;
@@ -319,16 +562,38 @@ void serve(client_info *client) {
 
 int main(int argc, char **argv) {
     int listenfd;
+    char *docroot = NULL;
+    int opt;
+    bool ok = true;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "m:zv")) != -1) {
+        if (opt == 'm') {
+            docroot = optarg;
+        } else if (opt == 'z') {
+            use_gzip = true;
+        } else if (opt == 'v') {
+            verbose = true;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || optind != argc - 1 ||
+            ((use_gzip || verbose) && docroot == NULL)) {
+        fprintf(stderr, "usage: %s [-m docroot [-z] [-v]] <port>\n", argv[0]);
         exit(1);
     }
 
-    listenfd = open_listenfd(argv[1]);
+    if (docroot != NULL) {
+        load_docroot(docroot);
+        in_memory = true;
+    } else {
+        verbose = true;
+    }
+
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
@@ -1,7 +1,28 @@
+#define _GNU_SOURCE
+
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
  *     GET method to serve static and dynamic content.
  *
+ * With -t N, connections are instead handed to a pool of N worker
+ * threads through a bounded queue, so that Tiny is not the bottleneck
+ * when it is used as the origin of concurrent proxy benchmarks.
+ *
+ * Static files are sent with sendfile(), from a small LRU cache of open
+ * descriptors and stat results keyed by path, so hot files skip open,
+ * stat and mmap entirely. Entries are trusted for FILE_CACHE_TTL seconds,
+ * after which the file is looked up again in case it changed.
+ *
+ * With -c N, CGI programs that speak the worker protocol are kept running
+ * in a pool of up to N processes per program instead of being forked for
+ * every request. A worker is started with TINY_CGI_WORKER=1 in its
+ * environment and pipes for stdin and stdout, and first writes the line
+ * "TINY-CGI/1". After that, for every request it reads a line holding the
+ * query string and writes a line with the length of its output, followed
+ * by the output itself, which is what it would have written to stdout as
+ * a plain CGI program. Programs that do not answer with that line are run
+ * the usual way from then on.
+ *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
@@ -14,18 +35,36 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #define HOSTLEN 256
 #define SERVLEN 8
 
+/* Connections accepted but not yet picked up by a worker thread */
+#define QUEUE_LEN 1024
+
+/* Files kept open, buckets of their hash table, and seconds they are
+ * trusted for */
+#define FILE_CACHE_SIZE 128
+#define FILE_CACHE_BUCKETS 256
+#define FILE_CACHE_TTL 2
+
+/* First line written by a CGI program that speaks the worker protocol */
+#define CGI_HELLO "TINY-CGI/1\n"
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
@@ -38,6 +77,71 @@ typedef struct {
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* Queue of accepted connections waiting for a worker thread. */
+typedef struct {
+    client_info *items[QUEUE_LEN];
+    size_t head;                // Next item to take
+    size_t count;               // Items in the queue
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} conn_queue;
+
+static conn_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+/* A file in the file cache. */
+typedef struct file_entry {
+    char path[MAXLINE];         // Path the file was opened with
+    int fd;                     // Open descriptor, or -1 if not readable
+    struct stat sbuf;           // Result of stat on path
+    time_t loaded;              // When fd and sbuf were obtained
+    int refs;                   // Users, plus one while in the cache
+    struct file_entry *hnext;   // Next entry in the same hash bucket
+    struct file_entry *prev;    // Neighbours in LRU order, most recent first
+    struct file_entry *next;
+} file_entry;
+
+/* Cache of open files, shared by all worker threads. */
+typedef struct {
+    file_entry *buckets[FILE_CACHE_BUCKETS];
+    file_entry *first;          // Most recently used
+    file_entry *last;           // Least recently used
+    size_t count;
+    pthread_mutex_t lock;
+} file_cache;
+
+static file_cache files = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* A persistent CGI worker process. */
+typedef struct cgi_worker {
+    pid_t pid;
+    int in;                     // Pipe to the worker's stdin
+    FILE *out;                  // Pipe from the worker's stdout
+    struct cgi_worker *next;    // Next idle worker of the same program
+} cgi_worker;
+
+/* The workers of one CGI program. */
+typedef struct cgi_pool {
+    char path[MAXLINE];         // Path of the program
+    bool unsupported;           // Whether it does not speak the protocol
+    int nworkers;               // Workers running or being started
+    cgi_worker *idle;           // Workers waiting for a request
+    pthread_cond_t freed;       // Signaled when a worker becomes available
+    struct cgi_pool *next;
+} cgi_pool;
+
+/* Most workers per CGI program, or 0 to fork for every request */
+static int cgi_max_workers = 0;
+
+static pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+static cgi_pool *cgi_pools = NULL;
+
 /* URI parsing results. */
 typedef enum {
     PARSE_ERROR,
@@ -128,15 +232,159 @@ void get_filetype(char *filename, char *filetype) {
 }
 
 
+/*
+ * file_hash - hash a path into a bucket of the file cache
+ */
+static size_t file_hash(const char *path) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 16777619u;
+    }
+    return hash % FILE_CACHE_BUCKETS;
+}
+
+/*
+ * file_unlink - remove an entry from the LRU list of the file cache.
+ * The cache lock must be held.
+ */
+static void file_unlink(file_entry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        files.first = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        files.last = entry->prev;
+    }
+}
+
+/*
+ * file_release - drop a reference to an entry, closing it with the last
+ * one. The cache lock must be held.
+ */
+static void file_release(file_entry *entry) {
+    if (--entry->refs == 0) {
+        if (entry->fd >= 0) {
+            close(entry->fd);
+        }
+        free(entry);
+    }
+}
+
+/*
+ * file_drop - remove an entry from the file cache. Users that still hold
+ * it keep it open until they are done. The cache lock must be held.
+ */
+static void file_drop(file_entry *entry) {
+    file_entry **pp = &files.buckets[file_hash(entry->path)];
+    while (*pp != entry) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = entry->hnext;
+    file_unlink(entry);
+    files.count--;
+    file_release(entry);
+}
+
+/*
+ * file_get - look up the file at path, from the file cache if possible
+ *
+ * Returns the entry, which must be given back with file_put, or NULL if
+ * the file does not exist. The descriptor is only opened for regular files
+ * the owner may read, and is -1 otherwise.
+ */
+file_entry *file_get(const char *path) {
+    time_t now = time(NULL);
+    size_t bucket = file_hash(path);
+
+    pthread_mutex_lock(&files.lock);
+    file_entry *entry = files.buckets[bucket];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->hnext;
+    }
+    if (entry != NULL && now - entry->loaded >= FILE_CACHE_TTL) {
+        file_drop(entry);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        /* Move to the front of the LRU list */
+        file_unlink(entry);
+        entry->prev = NULL;
+        entry->next = files.first;
+        if (files.first != NULL) {
+            files.first->prev = entry;
+        } else {
+            files.last = entry;
+        }
+        files.first = entry;
+        entry->refs++;
+        pthread_mutex_unlock(&files.lock);
+        return entry;
+    }
+    pthread_mutex_unlock(&files.lock);
+
+    /* Miss: load the file without holding the lock */
+    struct stat sbuf;
+    if (stat(path, &sbuf) < 0) {
+        return NULL;
+    }
+    int fd = -1;
+    if (S_ISREG(sbuf.st_mode) && (S_IRUSR & sbuf.st_mode)) {
+        fd = open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+
+    entry = Malloc(sizeof(file_entry));
+    strncpy(entry->path, path, MAXLINE - 1);
+    entry->path[MAXLINE - 1] = '\0';
+    entry->fd = fd;
+    entry->sbuf = sbuf;
+    entry->loaded = now;
+    entry->refs = 2;    // The caller and the cache
+
+    pthread_mutex_lock(&files.lock);
+    /* Another thread may have loaded the same path meanwhile; the newer
+     * entry simply shadows it until it is evicted */
+    if (files.count == FILE_CACHE_SIZE) {
+        file_drop(files.last);
+    }
+    entry->hnext = files.buckets[bucket];
+    files.buckets[bucket] = entry;
+    entry->prev = NULL;
+    entry->next = files.first;
+    if (files.first != NULL) {
+        files.first->prev = entry;
+    } else {
+        files.last = entry;
+    }
+    files.first = entry;
+    files.count++;
+    pthread_mutex_unlock(&files.lock);
+    return entry;
+}
+
+/*
+ * file_put - give back an entry obtained from file_get
+ */
+void file_put(file_entry *entry) {
+    pthread_mutex_lock(&files.lock);
+    file_release(entry);
+    pthread_mutex_unlock(&files.lock);
+}
+
 /*
  * serve_static - copy a file back to the client
  */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp;
+void serve_static(int fd, char *filename, file_entry *file) {
     char filetype[MAXLINE];
     char buf[MAXBUF];
     size_t buflen;
+    off_t filesize = file->sbuf.st_size;
 
     get_filetype(filename, filetype);
 
@@ -145,9 +393,9 @@ void serve_static(int fd, char *filename, int filesize) {
             "HTTP/1.0 200 OK\r\n" \
             "Server: Tiny Web Server\r\n" \
             "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
+            "Content-Length: %lld\r\n" \
             "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
+            (long long) filesize, filetype);
     if (buflen >= MAXBUF) {
         return; // Overflow!
     }
@@ -160,31 +408,58 @@ void serve_static(int fd, char *filename, int filesize) {
     }
 
 
-    /* Send response body to client */
-    srcfd = open(filename, O_RDONLY, 0);
-    if (srcfd < 0) {
-        perror(filename);
-        return;
+    /* Send response body to client. The offset is passed explicitly, so
+     * threads sharing the descriptor do not disturb each other */
+    off_t offset = 0;
+    while (offset < filesize) {
+        ssize_t n = sendfile(fd, file->fd, &offset, filesize - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                    filename);
+            return;
+        }
     }
+}
 
-    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    if (srcp == MAP_FAILED) {
-        perror("mmap");
-        close(srcfd);
-        return;
+/*
+ * cgi_environ - build the environment of a CGI program, which is ours
+ *     with name set to value
+ *
+ * Other threads may hold the malloc lock when we fork, so the child cannot
+ * call setenv itself. The parent builds the array, and frees it with
+ * cgi_environ_free once the child has been forked.
+ */
+static char **cgi_environ(const char *name, const char *value) {
+    size_t count = 0;
+    size_t namelen = strlen(name);
+    while (environ[count] != NULL) {
+        count++;
     }
-    close(srcfd);
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
-        fprintf(stderr, "Error writing static file \"%s\" to client\n",
-                filename);
-        // Fall through to cleanup
+    char **envp = Malloc((count + 2) * sizeof(char *));
+    char *entry = Malloc(namelen + strlen(value) + 2);
+    sprintf(entry, "%s=%s", name, value);
+    size_t n = 0;
+    envp[n++] = entry;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], name, namelen) != 0
+                || environ[i][namelen] != '=') {
+            envp[n++] = environ[i];
+        }
     }
+    envp[n] = NULL;
+    return envp;
+}
 
-    if (munmap(srcp, filesize) < 0) {
-        perror("munmap");
-        return;
-    }
+/*
+ * cgi_environ_free - free an environment built by cgi_environ
+ */
+static void cgi_environ_free(char **envp) {
+    free(envp[0]);
+    free(envp);
 }
 
 /*
@@ -209,33 +484,230 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return;
     }
 
+    /* Real server would set all CGI vars here */
+    char **envp = cgi_environ("QUERY_STRING", cgiargs);
+
     pid_t pid = fork();
     if (pid == 0) { /* Child */
-        /* Real server would set all CGI vars here */
-        setenv("QUERY_STRING", cgiargs, 1);
-
         /* Redirect stdout to client */
         dup2(fd, STDOUT_FILENO);
         close(fd);
 
         /* Run CGI program */
-        if (execve(filename, emptylist, environ) < 0) {
+        if (execve(filename, emptylist, envp) < 0) {
             perror(filename);
-            exit(1);  /* Exit child process */
+            _exit(1);  /* Exit child process */
         }
     }
-    else if (pid == -1) {
+    cgi_environ_free(envp);
+    if (pid == -1) {
         perror("fork");
         return;
     }
 
-    /* Parent waits for and reaps child */
-    if (wait(NULL) < 0) {
+    /* Parent waits for and reaps its own child, not another thread's */
+    if (waitpid(pid, NULL, 0) < 0) {
         perror("wait");
         return;
     }
 }
 
+/*
+ * cgi_stop - stop a worker process and free it
+ */
+void cgi_stop(cgi_worker *worker) {
+    close(worker->in);
+    if (worker->out != NULL) {
+        fclose(worker->out);
+    }
+    kill(worker->pid, SIGTERM);
+    if (waitpid(worker->pid, NULL, 0) < 0) {
+        perror("waitpid");
+    }
+    free(worker);
+}
+
+/*
+ * cgi_start - start a worker process running the program at path
+ *
+ * Returns the worker, or NULL if it could not be started. Sets
+ * *unsupported if the program does not speak the worker protocol.
+ */
+cgi_worker *cgi_start(const char *path, bool *unsupported) {
+    int to_child[2];
+    int from_child[2];
+    char *emptylist[] = { NULL };
+
+    *unsupported = false;
+    if (pipe2(to_child, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return NULL;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(to_child[0]);
+        close(to_child[1]);
+        return NULL;
+    }
+
+    char **envp = cgi_environ("TINY_CGI_WORKER", "1");
+    pid_t pid = fork();
+    if (pid == 0) { /* Child */
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        if (execve(path, emptylist, envp) < 0) {
+            perror(path);
+            _exit(1);
+        }
+    }
+    cgi_environ_free(envp);
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(to_child[1]);
+        close(from_child[0]);
+        return NULL;
+    }
+
+    cgi_worker *worker = Malloc(sizeof(cgi_worker));
+    worker->pid = pid;
+    worker->in = to_child[1];
+    worker->out = fdopen(from_child[0], "r");
+
+    /* Check that the program speaks the protocol */
+    char line[MAXLINE];
+    if (worker->out == NULL || fgets(line, sizeof(line), worker->out) == NULL
+            || strcmp(line, CGI_HELLO) != 0) {
+        *unsupported = worker->out != NULL;
+        if (worker->out == NULL) {
+            close(from_child[0]);
+        }
+        cgi_stop(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+/*
+ * cgi_take - get a worker for the program at path, starting one if there
+ * is room in its pool, or waiting for one to become idle otherwise
+ *
+ * Returns the worker and stores its pool in *poolp, or returns NULL if the
+ * program has to be run the usual way.
+ */
+cgi_worker *cgi_take(const char *path, cgi_pool **poolp) {
+    pthread_mutex_lock(&cgi_lock);
+    cgi_pool *pool = cgi_pools;
+    while (pool != NULL && strcmp(pool->path, path) != 0) {
+        pool = pool->next;
+    }
+    if (pool == NULL) {
+        pool = Calloc(1, sizeof(cgi_pool));
+        strncpy(pool->path, path, MAXLINE - 1);
+        pthread_cond_init(&pool->freed, NULL);
+        pool->next = cgi_pools;
+        cgi_pools = pool;
+    }
+    *poolp = pool;
+
+    while (!pool->unsupported) {
+        if (pool->idle != NULL) {
+            cgi_worker *worker = pool->idle;
+            pool->idle = worker->next;
+            pthread_mutex_unlock(&cgi_lock);
+            return worker;
+        }
+        if (pool->nworkers < cgi_max_workers) {
+            /* Start a worker without holding the lock */
+            pool->nworkers++;
+            pthread_mutex_unlock(&cgi_lock);
+            bool unsupported;
+            cgi_worker *worker = cgi_start(path, &unsupported);
+            if (worker != NULL) {
+                return worker;
+            }
+            pthread_mutex_lock(&cgi_lock);
+            pool->nworkers--;
+            pool->unsupported |= unsupported;
+            pthread_cond_broadcast(&pool->freed);
+            break;
+        }
+        pthread_cond_wait(&pool->freed, &cgi_lock);
+    }
+    pthread_mutex_unlock(&cgi_lock);
+    return NULL;
+}
+
+/*
+ * cgi_give - give a worker back to its pool once the request is done, or
+ * stop it if it failed
+ */
+void cgi_give(cgi_pool *pool, cgi_worker *worker, bool ok) {
+    if (!ok) {
+        cgi_stop(worker);
+    }
+    pthread_mutex_lock(&cgi_lock);
+    if (ok) {
+        worker->next = pool->idle;
+        pool->idle = worker;
+    } else {
+        pool->nworkers--;
+    }
+    pthread_cond_signal(&pool->freed);
+    pthread_mutex_unlock(&cgi_lock);
+}
+
+/*
+ * serve_worker - run a CGI program on behalf of the client, using one of
+ * its persistent workers
+ *
+ * Returns false if no worker could be used and nothing was sent to the
+ * client, in which case the program should be run the usual way.
+ */
+bool serve_worker(int fd, char *filename, char *cgiargs) {
+    char buf[MAXBUF];
+    size_t buflen;
+    cgi_pool *pool;
+
+    cgi_worker *worker = cgi_take(filename, &pool);
+    if (worker == NULL) {
+        return false;
+    }
+
+    /* Send the query string, and read the length of the output */
+    buflen = snprintf(buf, MAXBUF, "%s\n", cgiargs);
+    unsigned long long remaining;
+    if (buflen >= MAXBUF || rio_writen(worker->in, buf, buflen) < 0
+            || fgets(buf, MAXBUF, worker->out) == NULL
+            || sscanf(buf, "%llu", &remaining) != 1) {
+        cgi_give(pool, worker, false);
+        return false;
+    }
+
+    /* Write the response, the same way serve_dynamic does */
+    buflen = snprintf(buf, MAXBUF,
+            "HTTP/1.0 200 OK\r\n" \
+            "Server: Tiny Web Server\r\n");
+    bool client_ok = rio_writen(fd, buf, buflen) >= 0;
+    while (remaining > 0) {
+        size_t n = fread(buf, 1,
+                remaining < MAXBUF ? remaining : MAXBUF, worker->out);
+        if (n == 0) {
+            fprintf(stderr, "CGI worker for \"%s\" failed\n", filename);
+            cgi_give(pool, worker, false);
+            return true;
+        }
+        if (client_ok && rio_writen(fd, buf, n) < 0) {
+            fprintf(stderr, "Error writing dynamic response to client\n");
+            client_ok = false;
+        }
+        remaining -= n;
+    }
+    cgi_give(pool, worker, true);
+    return true;
+}
+
 /*
  * clienterror - returns an error message to the client
  */
@@ -384,6 +856,24 @@ void serve(client_info *client) {
         return;
     }
 
+    if (result == PARSE_STATIC) { /* Serve static content */
+        file_entry *file = file_get(filename);
+        if (file == NULL) {
+            clienterror(client->connfd, "404", "Not found",
+                        "Tiny couldn't find this file");
+            return;
+        }
+        if (file->fd < 0) {
+            clienterror(client->connfd, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+            file_put(file);
+            return;
+        }
+        serve_static(client->connfd, filename, file);
+        file_put(file);
+        return;
+    }
+
     /* Attempt to stat the file */
     struct stat sbuf;
     if (stat(filename, &sbuf) < 0) {
@@ -392,38 +882,131 @@ void serve(client_info *client) {
         return;
     }
 
-    if (result == PARSE_STATIC) { /* Serve static content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't read the file");
-            return;
+    /* Serve dynamic content */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+        clienterror(client->connfd, "403", "Forbidden",
+                    "Tiny couldn't run the CGI program");
+        return;
+    }
+    if (cgi_max_workers == 0 || !serve_worker(client->connfd, filename,
+                                              cgiargs)) {
+        serve_dynamic(client->connfd, filename, cgiargs);
+    }
+}
+
+/*
+ * queue_put - add an accepted connection to the queue, waiting for room
+ */
+void queue_put(client_info *client) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUE_LEN) {
+        pthread_cond_wait(&queue.not_full, &queue.lock);
+    }
+    queue.items[(queue.head + queue.count) % QUEUE_LEN] = client;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * queue_take - remove the oldest connection from the queue, waiting for one
+ */
+client_info *queue_take(void) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0) {
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+    }
+    client_info *client = queue.items[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_LEN;
+    queue.count--;
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.lock);
+    return client;
+}
+
+/*
+ * worker - body of a worker thread, serving connections from the queue
+ */
+void *worker(void *vargp) {
+    (void) vargp;
+    while (1) {
+        client_info *client = queue_take();
+        serve(client);
+        close(client->connfd);
+        free(client);
+    }
+    return NULL;
+}
+
+/*
+ * serve_pool - accept connections forever, serving them with nthreads
+ * worker threads
+ */
+void serve_pool(int listenfd, int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            exit(1);
         }
-        serve_static(client->connfd, filename, sbuf.st_size);
-    } else { /* Serve dynamic content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, "403", "Forbidden",
-                        "Tiny couldn't run the CGI program");
-            return;
+        pthread_detach(tid);
+    }
+
+    while (1) {
+        client_info *client = Malloc(sizeof(client_info));
+        client->addrlen = sizeof(client->addr);
+        client->connfd = accept4(listenfd,
+                (SA *) &client->addr, &client->addrlen, SOCK_CLOEXEC);
+        if (client->connfd < 0) {
+            perror("accept");
+            free(client);
+            continue;
         }
-        serve_dynamic(client->connfd, filename, cgiargs);
+        queue_put(client);
     }
 }
 
 int main(int argc, char **argv) {
     int listenfd;
+    int nthreads = 0;
+    int opt;
+    bool ok = true;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:c:")) != -1) {
+        if (opt == 't') {
+            ok &= (nthreads = atoi(optarg)) > 0;
+        } else if (opt == 'c') {
+            ok &= (cgi_max_workers = atoi(optarg)) > 0;
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t threads] [-c cgi_workers] <port>\n",
+                argv[0]);
         exit(1);
     }
 
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
+    /* Keep the listening socket and clients out of CGI processes, which
+     * may outlive the request that started them */
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+
+    /* A client or CGI worker hanging up early must not take Tiny down */
+    if (nthreads > 0 || cgi_max_workers > 0) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (nthreads > 0) {
+        serve_pool(listenfd, nthreads);
+    }
+
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -433,8 +1016,8 @@ int main(int argc, char **argv) {
         client->addrlen = sizeof(client->addr);
 
         /* accept() will block until a client connects to the port */
-        client->connfd = accept(listenfd,
-                (SA *) &client->addr, &client->addrlen);
+        client->connfd = accept4(listenfd,
+                (SA *) &client->addr, &client->addrlen, SOCK_CLOEXEC);
         if (client->connfd < 0) {
             perror("accept");
             continue;
@@ -0,0 +1,764 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the io_uring backend used by proxy.c
+ *
+ * The rings are driven through the raw syscalls and the shared memory layout
+ * described in <linux/io_uring.h>. See uring.h for an overview.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "csapp.h"
+#include "metrics.h"
+#include "timeout.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// entries in every submission ring
+#define RING_ENTRIES 256
+
+// buffer group id of the relay buffer ring
+#define RELAY_BGID 0
+
+// operation tags stored in the low bits of a completion's user_data. Loop
+// events carry no pointer for the eventfd, and one for the sweep timeout
+#define OP_RECV 0
+#define OP_SEND 1
+#define OP_CANCEL 2
+#define OP_EVENT 3
+#define OP_MASK 3
+
+#define NSEC_PER_SEC 1000000000ull
+
+/* Type for a mapped submission/completion ring pair
+ *
+ * sqe_tail is the next sqe handed out by ring_sqe, which is published to the
+ * kernel by the next ring_submit
+ */
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned submitted;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+} ring_t;
+
+/* Type for a connection owned by a relay loop
+ *
+ * Received buffers waiting to be sent to the client are kept in a FIFO,
+ * linked through the relay loop's next_bid array. send_off is how much of the
+ * head buffer has already been sent. accepted and sent are the times used for
+ * the latency metrics, and replied is set once the client got its first byte.
+ * ticket is the admission of the connection, and log its access log record,
+ * written once it is done. active is the time of the last recv or send, for
+ * the idle deadline, and prev and later link conn into the list of all
+ * connections of its loop.
+ */
+typedef struct relay_conn {
+    int clientfd;
+    int serverfd;
+    int head;
+    int tail;
+    unsigned nqueued;
+    unsigned send_off;
+    bool recv_armed;
+    bool send_busy;
+    bool cancel_busy;
+    bool starved;
+    bool eof;
+    bool dead;
+    bool replied;
+    uint64_t accepted;
+    uint64_t sent;
+    admit_ticket_t ticket;
+    log_record_t log;
+    uint64_t active;
+    struct relay_conn *next;
+    struct relay_conn *prev;
+    struct relay_conn *later;
+} relay_conn_t;
+
+/* Type for a relay loop. There is one of these per core
+ *
+ * incoming is filled by serving threads under lock and drained by the loop
+ * when it is woken through efd. starved holds connections whose recv ran out
+ * of buffers and must be rearmed once buffers are returned. conns holds every
+ * connection of the loop, which is swept for deadlines whenever the timeout
+ * in sweep expires.
+ */
+typedef struct {
+    ring_t ring;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned br_tail;
+    unsigned nfree;
+    int next_bid[URING_NBUFS];
+    unsigned len[URING_NBUFS];
+    bool multishot;
+    int efd;
+    uint64_t ebuf;
+    pthread_mutex_t lock;
+    relay_conn_t *incoming;
+    relay_conn_t *starved;
+    relay_conn_t *conns;
+    struct __kernel_timespec sweep;
+} relay_loop_t;
+
+static relay_loop_t *loops = NULL;
+static int num_loops = 0;
+static unsigned next_loop = 0;
+
+/* Maps the rings of a freshly created io_uring instance
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int ring_init(ring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_len > ring->sq_len) {
+        ring->sq_len = ring->cq_len;
+    }
+
+    ring->sq_ptr =
+        mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    // with a single mmap the completion ring lives in the same mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr =
+            mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_len);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_len);
+        }
+        munmap(ring->sq_ptr, ring->sq_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // sqes are always handed out in ring order, so the index array is fixed
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->sqe_tail = *ring->sq_tail;
+    ring->submitted = ring->sqe_tail;
+
+    return 0;
+}
+
+/* Unmaps the rings and closes the io_uring instance */
+static void ring_exit(ring_t *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/* Publishes every sqe handed out since the last call and enters the kernel,
+ * waiting for at least wait_nr completions
+ *
+ * Returns the number of sqes consumed, or -1 on error
+ */
+static int ring_submit(ring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - ring->submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->submitted = ring->sqe_tail;
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    int res;
+    do {
+        res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                      wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (res < 0 && errno == EINTR && wait_nr == 0);
+
+    return res;
+}
+
+/* Returns a zeroed sqe, submitting queued sqes first if the ring is full */
+static struct io_uring_sqe *ring_sqe(ring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (ring->sqe_tail - head >= ring->sq_entries) {
+        ring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail += 1;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Returns the next completion, or NULL if there is none */
+static struct io_uring_cqe *ring_peek(ring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Marks the completion returned by ring_peek as consumed */
+static void ring_seen(ring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns buffer bid to the relay loop's buffer ring */
+static void recycle_buf(relay_loop_t *loop, int bid) {
+    unsigned mask = URING_NBUFS - 1;
+    struct io_uring_buf *buf = &loop->br->bufs[loop->br_tail & mask];
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUFSIZE);
+    buf->len = URING_BUFSIZE;
+    buf->bid = bid;
+    loop->br_tail += 1;
+    __atomic_store_n(&loop->br->tail, (unsigned short)loop->br_tail,
+                     __ATOMIC_RELEASE);
+    loop->nfree += 1;
+}
+
+/* Allocates the buffers of a relay loop and registers them as a provided
+ * buffer ring, so recv can pick a buffer when data actually arrives
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int bufs_init(relay_loop_t *loop) {
+    size_t br_len = URING_NBUFS * sizeof(struct io_uring_buf);
+    loop->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->br == MAP_FAILED) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = RELAY_BGID;
+    if (syscall(__NR_io_uring_register, loop->ring.fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(loop->br, br_len);
+        return -1;
+    }
+
+    loop->bufs = Malloc((size_t)URING_NBUFS * URING_BUFSIZE);
+    loop->br_tail = 0;
+    loop->nfree = 0;
+    for (int bid = 0; bid < URING_NBUFS; bid++) {
+        recycle_buf(loop, bid);
+    }
+    return 0;
+}
+
+/* Arms a (multishot, if supported) recv on the server socket of conn */
+static void arm_recv(relay_loop_t *loop, relay_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->serverfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RELAY_BGID;
+    if (loop->multishot) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = (uintptr_t)conn | OP_RECV;
+    conn->recv_armed = true;
+}
+
+/* Cancels the multishot recv of conn, used to stop a fast server from
+ * queueing up every buffer behind a slow client
+ */
+static void cancel_recv(relay_loop_t *loop, relay_conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)conn | OP_RECV;
+    sqe->user_data = (uintptr_t)conn | OP_CANCEL;
+    conn->cancel_busy = true;
+}
+
+/* Sends the remainder of the head buffer of conn to the client, if no send
+ * is in flight already
+ */
+static void start_send(relay_loop_t *loop, relay_conn_t *conn) {
+    if (conn->send_busy || conn->head < 0) {
+        return;
+    }
+
+    int bid = conn->head;
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->clientfd;
+    sqe->addr = (uintptr_t)(loop->bufs + (size_t)bid * URING_BUFSIZE +
+                            conn->send_off);
+    sqe->len = loop->len[bid] - conn->send_off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)conn | OP_SEND;
+    conn->send_busy = true;
+}
+
+/* Rearms the recv of conn if it is still wanted and has room to queue */
+static void maybe_rearm(relay_loop_t *loop, relay_conn_t *conn) {
+    if (conn->recv_armed || conn->cancel_busy || conn->starved ||
+        conn->eof || conn->dead || conn->nqueued > URING_MAX_QUEUED / 2) {
+        return;
+    }
+    arm_recv(loop, conn);
+}
+
+/* Tears down conn on error. Shutting the sockets down forces any recv or
+ * send still in flight to complete, after which conn is freed
+ */
+static void fail(relay_conn_t *conn) {
+    if (conn->dead) {
+        return;
+    }
+    conn->dead = true;
+    shutdown(conn->serverfd, SHUT_RDWR);
+    shutdown(conn->clientfd, SHUT_RDWR);
+}
+
+/* Closes and frees conn once the response has been fully relayed (or it
+ * failed) and nothing the kernel could still complete refers to it
+ */
+static void maybe_finish(relay_loop_t *loop, relay_conn_t *conn) {
+    if (conn->recv_armed || conn->send_busy || conn->cancel_busy ||
+        conn->starved) {
+        return;
+    }
+    if (!conn->dead && !(conn->eof && conn->head < 0)) {
+        return;
+    }
+
+    // give back anything that was never sent
+    while (conn->head >= 0) {
+        int bid = conn->head;
+        conn->head = loop->next_bid[bid];
+        recycle_buf(loop, bid);
+    }
+
+    // unlink conn from the list of all connections
+    if (conn->prev != NULL) {
+        conn->prev->later = conn->later;
+    } else {
+        loop->conns = conn->later;
+    }
+    if (conn->later != NULL) {
+        conn->later->prev = conn->prev;
+    }
+
+    metrics_since(METRIC_TOTAL, conn->accepted);
+    conn->log.duration = (metrics_now() - conn->accepted) / 1000;
+    accesslog_write(&conn->log);
+    admit_release(conn->ticket);
+    close(conn->serverfd);
+    close(conn->clientfd);
+    free(conn);
+}
+
+/* Handles the completion of a recv on the server socket */
+static void on_recv(relay_loop_t *loop, relay_conn_t *conn, int res,
+                    unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+    }
+
+    if (res > 0) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        loop->nfree -= 1;
+        metrics_since(METRIC_TTFB, conn->sent);
+        conn->sent = 0;
+        conn->active = metrics_now();
+        if (conn->dead) {
+            recycle_buf(loop, bid);
+        } else {
+            // append the buffer to the send queue of conn
+            loop->len[bid] = res;
+            loop->next_bid[bid] = -1;
+            if (conn->head < 0) {
+                conn->head = bid;
+            } else {
+                loop->next_bid[conn->tail] = bid;
+            }
+            conn->tail = bid;
+            conn->nqueued += 1;
+            start_send(loop, conn);
+
+            if (conn->recv_armed && !conn->cancel_busy &&
+                conn->nqueued >= URING_MAX_QUEUED) {
+                cancel_recv(loop, conn);
+            }
+        }
+    } else if (res == 0) {
+        conn->eof = true;
+    } else if (res == -ENOBUFS) {
+        // wait for buffers to come back before asking again
+        if (!conn->dead) {
+            conn->starved = true;
+            conn->next = loop->starved;
+            loop->starved = conn;
+        }
+    } else if (res == -EINVAL && loop->multishot) {
+        // this kernel has no multishot recv, retry with single shot recvs
+        loop->multishot = false;
+    } else if (res != -ECANCELED) {
+        fail(conn);
+    }
+
+    maybe_rearm(loop, conn);
+    maybe_finish(loop, conn);
+}
+
+/* Handles the completion of a send to the client */
+static void on_send(relay_loop_t *loop, relay_conn_t *conn, int res) {
+    conn->send_busy = false;
+
+    if (res < 0) {
+        fail(conn);
+    } else if (!conn->dead) {
+        metrics_count(METRIC_BYTES, res);
+        conn->log.bytes += res;
+        conn->active = metrics_now();
+        if (!conn->replied) {
+            metrics_since(METRIC_FIRST_BYTE, conn->accepted);
+            admit_observe(conn->accepted);
+            conn->replied = true;
+        }
+        conn->send_off += res;
+        int bid = conn->head;
+        if (conn->send_off == loop->len[bid]) {
+            conn->head = loop->next_bid[bid];
+            conn->nqueued -= 1;
+            conn->send_off = 0;
+            recycle_buf(loop, bid);
+        }
+        start_send(loop, conn);
+    }
+
+    maybe_rearm(loop, conn);
+    maybe_finish(loop, conn);
+}
+
+/* Arms a read on the wakeup eventfd of a relay loop */
+static void arm_event(relay_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->efd;
+    sqe->addr = (uintptr_t)&loop->ebuf;
+    sqe->len = sizeof(loop->ebuf);
+    sqe->user_data = OP_EVENT;
+}
+
+/* Starts relaying every connection handed over since the last wakeup */
+static void on_event(relay_loop_t *loop) {
+    pthread_mutex_lock(&loop->lock);
+    relay_conn_t *conn = loop->incoming;
+    loop->incoming = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (conn != NULL) {
+        relay_conn_t *next = conn->next;
+        conn->active = metrics_now();
+        conn->prev = NULL;
+        conn->later = loop->conns;
+        if (loop->conns != NULL) {
+            loop->conns->prev = conn;
+        }
+        loop->conns = conn;
+        arm_recv(loop, conn);
+        conn = next;
+    }
+    arm_event(loop);
+}
+
+/* Arms the timeout after which a relay loop sweeps its connections */
+static void arm_sweep(relay_loop_t *loop) {
+    loop->sweep.tv_sec = URING_SWEEP_MS / 1000;
+    loop->sweep.tv_nsec = (URING_SWEEP_MS % 1000) * 1000000;
+
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->sweep;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)&loop->sweep | OP_EVENT;
+}
+
+/* Tears down every connection of a relay loop that missed its idle or total
+ * deadline (see timeout.h)
+ */
+static void on_sweep(relay_loop_t *loop) {
+    uint64_t now = metrics_now();
+    uint64_t idle = timeout_opts.idle * NSEC_PER_SEC;
+    uint64_t total = timeout_opts.total * NSEC_PER_SEC;
+
+    relay_conn_t *conn = loop->conns;
+    while (conn != NULL) {
+        relay_conn_t *later = conn->later;
+        if (!conn->dead &&
+            ((idle > 0 && now - conn->active > idle) ||
+             (total > 0 && now - conn->accepted > total))) {
+            metrics_count(METRIC_TIMEOUTS, 1);
+            fail(conn);
+            maybe_finish(loop, conn);
+        }
+        conn = later;
+    }
+    arm_sweep(loop);
+}
+
+/* Rearms connections that ran out of buffers, now that some are free */
+static void rearm_starved(relay_loop_t *loop) {
+    relay_conn_t *conn = loop->starved;
+    loop->starved = NULL;
+
+    while (conn != NULL) {
+        relay_conn_t *next = conn->next;
+        conn->starved = false;
+        if (conn->dead) {
+            maybe_finish(loop, conn);
+        } else {
+            arm_recv(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/* Body of a relay loop thread
+ *
+ * Every iteration submits everything queued up by the previous one and
+ * waits for at least one completion in the same syscall
+ */
+static void *relay_loop(void *vargp) {
+    relay_loop_t *loop = (relay_loop_t *)vargp;
+    pthread_detach(pthread_self());
+
+    arm_event(loop);
+    arm_sweep(loop);
+    while (true) {
+        if (ring_submit(&loop->ring, 1) < 0 && errno != EINTR &&
+            errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek(&loop->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_seen(&loop->ring);
+
+            relay_conn_t *conn = (relay_conn_t *)(uintptr_t)(data & ~OP_MASK);
+            switch (data & OP_MASK) {
+            case OP_RECV:
+                on_recv(loop, conn, res, flags);
+                break;
+            case OP_SEND:
+                on_send(loop, conn, res);
+                break;
+            case OP_CANCEL:
+                conn->cancel_busy = false;
+                maybe_rearm(loop, conn);
+                maybe_finish(loop, conn);
+                break;
+            case OP_EVENT:
+                if (conn == NULL) {
+                    on_event(loop);
+                } else {
+                    on_sweep(loop);
+                }
+                break;
+            }
+        }
+
+        if (loop->starved != NULL && loop->nfree > 0) {
+            rearm_starved(loop);
+        }
+    }
+    return NULL;
+}
+
+/* Starts nloops relay loops, each with its own ring and thread
+ *
+ * Returns 0 on success, or -1 if io_uring is not usable on this kernel
+ */
+int uring_init(int nloops) {
+    if (nloops < 1) {
+        nloops = 1;
+    }
+
+    loops = Calloc(nloops, sizeof(relay_loop_t));
+    for (int i = 0; i < nloops; i++) {
+        relay_loop_t *loop = &loops[i];
+        if (ring_init(&loop->ring, RING_ENTRIES) < 0) {
+            break;
+        }
+        if (bufs_init(loop) < 0) {
+            ring_exit(&loop->ring);
+            break;
+        }
+        loop->efd = eventfd(0, EFD_CLOEXEC);
+        if (loop->efd < 0) {
+            ring_exit(&loop->ring);
+            break;
+        }
+        loop->multishot = true;
+        pthread_mutex_init(&loop->lock, NULL);
+        num_loops = i + 1;
+    }
+
+    // not even one loop could be set up, io_uring is not available
+    if (num_loops == 0) {
+        free(loops);
+        loops = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < num_loops; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, relay_loop, &loops[i]);
+    }
+    return 0;
+}
+
+/* Hands a connection over to one of the relay loops, in round robin order */
+void uring_relay(int clientfd, int serverfd, uint64_t accepted, uint64_t sent,
+                 admit_ticket_t ticket, const log_record_t *log) {
+    relay_conn_t *conn = Calloc(1, sizeof(relay_conn_t));
+    conn->clientfd = clientfd;
+    conn->serverfd = serverfd;
+    conn->accepted = accepted;
+    conn->sent = sent;
+    conn->replied = sent == 0;
+    conn->ticket = ticket;
+    conn->log = *log;
+    conn->head = -1;
+    conn->tail = -1;
+
+    unsigned idx = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED);
+    relay_loop_t *loop = &loops[idx % num_loops];
+
+    pthread_mutex_lock(&loop->lock);
+    conn->next = loop->incoming;
+    loop->incoming = conn;
+    pthread_mutex_unlock(&loop->lock);
+
+    // wake the loop up, it picks up everything in incoming at once
+    uint64_t one = 1;
+    if (write(loop->efd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+    }
+}
+
+/* Arms an accept on listenfd, as a multishot accept if multishot is set */
+static void arm_accept(ring_t *ring, int listenfd, bool multishot) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+/* Accepts connections on listenfd with a multishot accept, calling handle
+ * with every new connected descriptor
+ *
+ * Only returns if the accept ring could not be set up
+ */
+void uring_accept_loop(int listenfd, void (*handle)(int connfd)) {
+    ring_t ring;
+    if (ring_init(&ring, 64) < 0) {
+        return;
+    }
+
+    bool multishot = true;
+    arm_accept(&ring, listenfd, multishot);
+    while (true) {
+        if (ring_submit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek(&ring)) != NULL) {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_seen(&ring);
+
+            if (res >= 0) {
+                handle(res);
+            } else if (res == -EINVAL && multishot) {
+                // this kernel has no multishot accept
+                multishot = false;
+            } else {
+                fprintf(stderr, "accept failed: %s\n", strerror(-res));
+            }
+
+            if (!(flags & IORING_CQE_F_MORE)) {
+                arm_accept(&ring, listenfd, multishot);
+            }
+        }
+    }
+}
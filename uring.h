@@ -0,0 +1,88 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for uring.c
+ *
+ * These files implement an optional io_uring backend for proxy.c. It talks
+ * to the kernel through the raw io_uring syscalls, so no extra library is
+ * needed to build the proxy.
+ *
+ * The backend provides two things:
+ *  - an accept loop that keeps a single multishot accept armed on the
+ *    listening socket, so a burst of connections is reaped with one syscall
+ *  - relay loops, one per core, each owning its own submission ring. Once a
+ *    serving task knows a response is too big for the cache it hands the
+ *    client and server sockets to a relay loop, which moves the rest of the
+ *    response with multishot recv into a registered (provided) buffer ring,
+ *    and sends every buffer straight back out of the same memory. All
+ *    recv/send submissions for all connections on a core are batched into
+ *    one io_uring_enter per iteration
+ *
+ * Responses that may be cached are relayed by the epoll event loops (see
+ * loop.h) from start to end, since the proxy has to keep a copy of them, and
+ * so are cache hits. Only responses that outgrow MAX_OBJECT_SIZE move to a
+ * relay loop, and only after their first MAX_OBJECT_SIZE bytes or so went
+ * through the event loop. For ordinary cacheable traffic -u therefore
+ * changes how connections are accepted, not how data is moved.
+ *
+ * Relay loops enforce the idle and total deadlines of timeout.h themselves,
+ * by sweeping their connections every URING_SWEEP_MS with a ring timeout.
+ *
+ * When the running kernel does not support io_uring, uring_init fails and the
+ * caller is expected to fall back to the epoll event loops.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "accesslog.h"
+#include "admit.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// number of buffers and size of each buffer in every relay loop's buffer ring
+#define URING_NBUFS 256
+#define URING_BUFSIZE (16 * 1024)
+
+// most buffers a single connection may have queued before recv is paused
+#define URING_MAX_QUEUED 16
+
+// interval at which relay loops check the deadlines of their connections
+#define URING_SWEEP_MS 1000
+
+/* Starts nloops relay loops, each with its own ring and thread
+ *
+ * Returns 0 on success, or -1 if io_uring is not usable on this kernel
+ */
+int uring_init(int nloops);
+
+/* Hands a connection over to one of the relay loops
+ *
+ * Everything the server sends on serverfd is forwarded to clientfd until the
+ * server closes the connection. The relay loop takes ownership of both file
+ * descriptors and closes them when it is done.
+ *
+ * accepted and sent are the times (see metrics.h) at which the connection was
+ * accepted and the request was sent, for the latency metrics of the relay.
+ * sent is 0 if part of the response has been relayed already, in which case
+ * those metrics have been recorded.
+ * ticket is the admission of the connection (see admit.h), which is given
+ * back once it is done
+ * log is the access log record of the request, with the bytes relayed so far.
+ * It is copied, and logged with the rest of the bytes and the duration once
+ * the relay is done
+ *
+ * uring_init must have returned successfully before this is called
+ */
+void uring_relay(int clientfd, int serverfd, uint64_t accepted, uint64_t sent,
+                 admit_ticket_t ticket, const log_record_t *log);
+
+/* Accepts connections on listenfd with a multishot accept, calling handle
+ * with every new connected descriptor
+ *
+ * Only returns if the accept ring could not be set up, in which case the
+ * caller should fall back to accept(2)
+ */
+void uring_accept_loop(int listenfd, void (*handle)(int connfd));
+
+#endif /* URING_H */
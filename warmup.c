@@ -0,0 +1,207 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file implements the cache warmup of proxy.c
+ *
+ * Running fetches are counted under a lock, and the warmup thread waits on a
+ * condition variable for a free slot before starting each fetch. The URLs
+ * seen so far are kept in a hash set, since an access log mentions popular
+ * URLs over and over.
+ *
+ * See warmup.h for more
+ */
+
+#define _GNU_SOURCE
+
+#include "warmup.h"
+#include "csapp.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// initial number of buckets of the set of URLs seen
+#define SEEN_BUCKETS 1024
+
+/* Type for a URL in the set of URLs seen */
+typedef struct seen {
+    struct seen *next;
+    char url[];
+} seen_t;
+
+/* Type for the set of URLs seen, a hash table with chaining */
+typedef struct {
+    seen_t **buckets;
+    size_t nbuckets;
+    size_t count;
+} seen_set_t;
+
+static FILE *warmup_file = NULL;
+static warmup_fn *warmup_fetch = NULL;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+
+/* Returns the FNV-1a hash of the len bytes at s */
+static uint64_t hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* Adds the len bytes at url to set
+ *
+ * Returns true if it was not in there yet
+ */
+static bool add_seen(seen_set_t *set, const char *url, size_t len) {
+    uint64_t h = hash(url, len);
+    for (seen_t *s = set->buckets[h % set->nbuckets]; s != NULL; s = s->next) {
+        if (strlen(s->url) == len && memcmp(s->url, url, len) == 0) {
+            return false;
+        }
+    }
+
+    // keep the chains short by doubling the table as it fills up
+    if (set->count == set->nbuckets) {
+        size_t nbuckets = set->nbuckets * 2;
+        seen_t **buckets = Calloc(nbuckets, sizeof(seen_t *));
+        for (size_t i = 0; i < set->nbuckets; i++) {
+            seen_t *s = set->buckets[i];
+            while (s != NULL) {
+                seen_t *next = s->next;
+                seen_t **b = &buckets[hash(s->url, strlen(s->url)) % nbuckets];
+                s->next = *b;
+                *b = s;
+                s = next;
+            }
+        }
+        free(set->buckets);
+        set->buckets = buckets;
+        set->nbuckets = nbuckets;
+    }
+
+    seen_t *s = Malloc(sizeof(seen_t) + len + 1);
+    memcpy(s->url, url, len);
+    s->url[len] = '\0';
+    s->next = set->buckets[h % set->nbuckets];
+    set->buckets[h % set->nbuckets] = s;
+    set->count += 1;
+    return true;
+}
+
+/* Frees set and everything in it */
+static void free_seen(seen_set_t *set) {
+    for (size_t i = 0; i < set->nbuckets; i++) {
+        seen_t *s = set->buckets[i];
+        while (s != NULL) {
+            seen_t *next = s->next;
+            free(s);
+            s = next;
+        }
+    }
+    free(set->buckets);
+}
+
+/* Finds the URL in a line of the file, either the whole line of a manifest,
+ * or the URI of a GET request in a log line
+ *
+ * Returns a pointer to the URL and stores its length in *len, or returns NULL
+ * if the line has none
+ */
+static const char *find_url(const char *line, size_t *len) {
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    // a log line has the request quoted, as in "GET uri HTTP/1.0"
+    const char *quote = strchr(line, '"');
+    if (line[0] != '#' && quote != NULL) {
+        if (strncmp(quote + 1, "GET ", 4) != 0) {
+            return NULL;
+        }
+        line = quote + 5;
+    }
+
+    if (strncmp(line, "http://", 7) != 0) {
+        return NULL;
+    }
+    const char *end = line;
+    while (*end != '\0' && *end != '"' && !isspace((unsigned char)*end)) {
+        end++;
+    }
+    *len = end - line;
+    return line;
+}
+
+/* Waits until fewer than WARMUP_CONCURRENCY fetches are running, and takes
+ * a slot for another one
+ */
+static void take_slot(void) {
+    pthread_mutex_lock(&slots_lock);
+    while (running >= WARMUP_CONCURRENCY) {
+        pthread_cond_wait(&slot_free, &slots_lock);
+    }
+    running += 1;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+/* Body of the warmup thread */
+static void *warmup(void *vargp) {
+    pthread_detach(pthread_self());
+
+    seen_set_t seen = {Calloc(SEEN_BUCKETS, sizeof(seen_t *)), SEEN_BUCKETS, 0};
+    char *line = NULL;
+    size_t cap = 0;
+    size_t fetched = 0;
+    while (getline(&line, &cap, warmup_file) >= 0) {
+        size_t len;
+        const char *url = find_url(line, &len);
+        if (url == NULL || len >= MAXLINE || !add_seen(&seen, url, len)) {
+            continue;
+        }
+
+        char uri[MAXLINE];
+        memcpy(uri, url, len);
+        uri[len] = '\0';
+        take_slot();
+        if (warmup_fetch(uri)) {
+            fetched += 1;
+        } else {
+            warmup_done();
+        }
+    }
+
+    fprintf(stderr, "Warmup started fetching %zu URLs\n", fetched);
+    free(line);
+    free_seen(&seen);
+    fclose(warmup_file);
+    return NULL;
+}
+
+/* Starts a thread warming the cache up with the URLs in the file at path */
+int warmup_start(const char *path, warmup_fn *fetch) {
+    warmup_file = fopen(path, "r");
+    if (warmup_file == NULL) {
+        return -1;
+    }
+    warmup_fetch = fetch;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, warmup, NULL) != 0) {
+        fclose(warmup_file);
+        return -1;
+    }
+    return 0;
+}
+
+/* Notes that a fetch started by warmup is done */
+void warmup_done(void) {
+    pthread_mutex_lock(&slots_lock);
+    running -= 1;
+    pthread_cond_signal(&slot_free);
+    pthread_mutex_unlock(&slots_lock);
+}
@@ -0,0 +1,40 @@
+/* @author William Giraldo (wgiraldo)
+ *
+ * This file consists of prototypes and definitions for warmup.c
+ *
+ * These files warm the cache of proxy.c up from a file of URLs, so a freshly
+ * started proxy does not send a storm of misses to the servers. The file is
+ * either a manifest, with one URL per line and # starting a comment, or an
+ * access log (see accesslog.h) or any other log in Common Log Format, from
+ * which the URLs of GET requests are taken. Every URL is fetched once.
+ *
+ * The file is read by a thread of its own, which hands every URL to a
+ * function of the proxy that fetches it in the background, on the same
+ * path as a request from a client, while the proxy serves traffic as usual.
+ * At most WARMUP_CONCURRENCY fetches run at once.
+ */
+
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stdbool.h>
+
+// most warmup fetches running at once
+#define WARMUP_CONCURRENCY 8
+
+/* Type of the function that starts fetching uri in the background. Returns
+ * true if it did, in which case warmup_done must be called once it is done
+ */
+typedef bool warmup_fn(const char *uri);
+
+/* Starts a thread warming the cache up with the URLs in the file at path,
+ * calling fetch for each of them
+ *
+ * Returns 0 on success, or -1 if the file cannot be opened
+ */
+int warmup_start(const char *path, warmup_fn *fetch);
+
+/* Notes that a fetch started by warmup is done */
+void warmup_done(void);
+
+#endif /* WARMUP_H */